@@ -12,48 +12,411 @@
 #include <string.h>    // strerror
 #include "base64.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSSE3, AVX2
+#define BASE64_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BASE64_NEON 1
+#endif
+
 static const unsigned char base64_table[65] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const unsigned char base64_url_table[65] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* Reverse of base64_table: 0x80 marks characters outside the alphabet, which
+ * are skipped, and '=' decodes to 0. */
+static const unsigned char base64_dtable[256] = {
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x00, 0x80, 0x80,
+	0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+/*
+ * Vector kernels. An encode kernel converts whole groups of input bytes from
+ * the first len bytes of src, reading at most avail bytes, and returns the
+ * number of bytes consumed. It may run in place, with out at least 32 bytes
+ * behind src. A decode kernel converts whole groups of
+ * characters as long as they are all in the alphabet, so it stops before any
+ * line feed or padding, and returns the number of characters consumed. The
+ * callers finish with the scalar code.
+ */
+typedef size_t (*base64_encode_kernel)(const unsigned char *src, size_t len,
+				       size_t avail, unsigned char *out,
+				       int url);
+typedef size_t (*base64_decode_kernel)(const unsigned char *src, size_t len,
+				       unsigned char *out);
+
+#ifdef BASE64_X86
+/* 12 bytes to 16 characters, see http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html */
+__attribute__((target("ssse3")))
+static inline __m128i base64_encode_sse(__m128i in, __m128i shift_lut)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					       4, 5, 3, 4, 1, 2, 0, 1));
+
+	const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	const __m128i indices = _mm_or_si128(t1, t3);
+
+	__m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+
+	return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, result), indices);
+}
+
+/* 16 characters to 12 bytes, or -1 in the mask if one is not in the alphabet */
+__attribute__((target("ssse3")))
+static inline __m128i base64_decode_sse(__m128i in, int *invalid)
+{
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+		0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71,
+		-71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+	const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+	const __m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+	const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+	const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+	*invalid = _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi),
+						    _mm_setzero_si128()));
+
+	const __m128i eq_2f = _mm_cmpeq_epi8(in, mask_2f);
+	const __m128i roll = _mm_shuffle_epi8(lut_roll,
+					      _mm_add_epi8(eq_2f, hi_nibbles));
+	const __m128i values = _mm_add_epi8(in, roll);
+
+	const __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	const __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+
+	return _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+						      8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(const unsigned char *src, size_t len,
+				  size_t avail, unsigned char *out, int url)
+{
+	const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, (url ? '-' : '+') - 62,
+		(url ? '_' : '/') - 63, 'A', 0, 0);
+	size_t i = 0;
+
+	while (len - i >= 12 && avail - i >= 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) out, base64_encode_sse(in, shift_lut));
+		i += 12;
+		out += 16;
+	}
+
+	return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(const unsigned char *src, size_t len,
+				  unsigned char *out)
+{
+	size_t i = 0;
+	int invalid;
+
+	while (len - i >= 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i res = base64_decode_sse(in, &invalid);
+		if (invalid)
+			break;
+		_mm_storeu_si128((__m128i *) out, res);
+		i += 16;
+		out += 12;
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t base64_encode_avx2(const unsigned char *src, size_t len,
+				 size_t avail, unsigned char *out, int url)
+{
+	const char plus = (url ? '-' : '+') - 62, slash = (url ? '_' : '/') - 63;
+	const __m256i shift_lut = _mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, plus,
+		slash, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, plus,
+		slash, 'A', 0, 0);
+	size_t i = 0;
+
+	while (len - i >= 24 && avail - i >= 28) {
+		__m128i lo = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *) (src + i + 12));
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+		in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+
+		const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+		const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+		const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		const __m256i indices = _mm256_or_si256(t1, t3);
+
+		__m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		result = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, result), indices);
+
+		_mm256_storeu_si256((__m256i *) out, result);
+		i += 24;
+		out += 32;
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t base64_decode_avx2(const unsigned char *src, size_t len,
+				 unsigned char *out)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	size_t i = 0;
+
+	while (len - i >= 32) {
+		__m256i in = _mm256_loadu_si256((const __m256i *) (src + i));
+
+		const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+		const __m256i lo_nibbles = _mm256_and_si256(in, mask_2f);
+		const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+
+		const __m256i eq_2f = _mm256_cmpeq_epi8(in, mask_2f);
+		const __m256i roll = _mm256_shuffle_epi8(lut_roll,
+							 _mm256_add_epi8(eq_2f, hi_nibbles));
+		const __m256i values = _mm256_add_epi8(in, roll);
+
+		const __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+		__m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+		packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		packed = _mm256_permutevar8x32_epi32(packed,
+			_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+
+		_mm256_storeu_si256((__m256i *) out, packed);
+		i += 32;
+		out += 24;
+	}
+
+	return i;
+}
+#endif /* BASE64_X86 */
+
+#ifdef BASE64_NEON
+static size_t base64_encode_neon(const unsigned char *src, size_t len,
+				 size_t avail, unsigned char *out, int url)
+{
+	const unsigned char *alphabet = url ? base64_url_table : base64_table;
+	uint8x16x4_t table;
+	size_t i = 0;
+
+	(void) avail;
+	table.val[0] = vld1q_u8(alphabet);
+	table.val[1] = vld1q_u8(alphabet + 16);
+	table.val[2] = vld1q_u8(alphabet + 32);
+	table.val[3] = vld1q_u8(alphabet + 48);
+
+	while (len - i >= 48) {
+		uint8x16x3_t in = vld3q_u8(src + i);
+		uint8x16x4_t res;
+		const uint8x16_t mask = vdupq_n_u8(0x3f);
+
+		res.val[0] = vshrq_n_u8(in.val[0], 2);
+		res.val[1] = vandq_u8(vorrq_u8(vshrq_n_u8(in.val[1], 4),
+					       vshlq_n_u8(in.val[0], 4)), mask);
+		res.val[2] = vandq_u8(vorrq_u8(vshrq_n_u8(in.val[2], 6),
+					       vshlq_n_u8(in.val[1], 2)), mask);
+		res.val[3] = vandq_u8(in.val[2], mask);
+
+		res.val[0] = vqtbl4q_u8(table, res.val[0]);
+		res.val[1] = vqtbl4q_u8(table, res.val[1]);
+		res.val[2] = vqtbl4q_u8(table, res.val[2]);
+		res.val[3] = vqtbl4q_u8(table, res.val[3]);
+
+		vst4q_u8(out, res);
+		i += 48;
+		out += 64;
+	}
+
+	return i;
+}
+
+static size_t base64_decode_neon(const unsigned char *src, size_t len,
+				 unsigned char *out)
+{
+	uint8x16x4_t lo_table, hi_table;
+	size_t i = 0;
+	int k;
+
+	for (k = 0; k < 4; k++) {
+		lo_table.val[k] = vld1q_u8(base64_dtable + 16 * k);
+		hi_table.val[k] = vld1q_u8(base64_dtable + 64 + 16 * k);
+	}
+
+	while (len - i >= 64) {
+		uint8x16x4_t in = vld4q_u8(src + i);
+		uint8x16_t bad = vdupq_n_u8(0);
+		uint8x16x3_t res;
+
+		for (k = 0; k < 4; k++) {
+			const uint8x16_t c = in.val[k];
+			const uint8x16_t d = vorrq_u8(vqtbl4q_u8(lo_table, c),
+				vqtbl4q_u8(hi_table, vsubq_u8(c, vdupq_n_u8(64))));
+
+			/* 0x80 in the table, outside ASCII or padding */
+			bad = vorrq_u8(bad, vorrq_u8(d, vcgeq_u8(c, vdupq_n_u8(0x80))));
+			bad = vorrq_u8(bad, vceqq_u8(c, vdupq_n_u8('=')));
+			in.val[k] = d;
+		}
+		if (vmaxvq_u8(bad) & 0x80)
+			break;
+
+		res.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+		res.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+		res.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+
+		vst3q_u8(out, res);
+		i += 64;
+		out += 48;
+	}
+
+	return i;
+}
+#endif /* BASE64_NEON */
+
+static base64_encode_kernel base64_select_encode(void)
+{
+#if defined(BASE64_X86)
+	if (__builtin_cpu_supports("avx2"))
+		return base64_encode_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return base64_encode_ssse3;
+#elif defined(BASE64_NEON)
+	return base64_encode_neon;
+#endif
+	return NULL;
+}
+
+static base64_decode_kernel base64_select_decode(void)
+{
+#if defined(BASE64_X86)
+	if (__builtin_cpu_supports("avx2"))
+		return base64_decode_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return base64_decode_ssse3;
+#elif defined(BASE64_NEON)
+	return base64_decode_neon;
+#endif
+	return NULL;
+}
 
 /**
- * base64_encode - Base64 encode
- * @src: Data to be encoded
+ * base64_encode_bound - Size of the buffer base64_encode_into needs
  * @len: Length of the data to be encoded
- * @out_len: Pointer to output length variable, or %NULL if not used
- * Returns: Allocated buffer of out_len bytes of encoded data,
- * or %NULL on failure
- *
- * Caller is responsible for freeing the returned buffer. Returned buffer is
- * nul terminated to make it easier to use as a C string. The nul terminator is
- * not included in out_len.
+ * @flags: BASE64_URL_SAFE, BASE64_NO_WRAP or 0
+ * Returns: Number of bytes, including the nul termination
  */
-unsigned char * base64_encode(const unsigned char *src, size_t len,
-			      size_t *out_len)
+size_t base64_encode_bound(size_t len, int flags)
 {
-	unsigned char *out, *pos;
-	const unsigned char *end, *in;
 	size_t olen;
-	int line_len;
 
 	olen = len * 4 / 3 + 4; /* 3-byte blocks to 4-byte */
-	olen += olen / 72; /* line feeds */
+	if (!(flags & (BASE64_URL_SAFE | BASE64_NO_WRAP)))
+		olen += olen / 72; /* line feeds */
 	olen++; /* nul termination */
-	if (olen < len)
-		return NULL; /* integer overflow */
-	out = malloc(olen);
-	if (out == NULL)
-		return NULL;
+	return olen;
+}
+
+/**
+ * base64_encode_into - Base64 encode into a caller buffer
+ * @src: Data to be encoded
+ * @len: Length of the data to be encoded
+ * @out: Buffer of at least base64_encode_bound(len, flags) bytes. It may
+ * overlap src if it starts at least base64_encode_bound(len, flags) - len + 32
+ * bytes before it.
+ * @flags: BASE64_URL_SAFE, BASE64_NO_WRAP or 0
+ * Returns: Length of the encoded data, without the nul termination
+ */
+size_t base64_encode_into(const unsigned char *src, size_t len,
+			  unsigned char *out, int flags)
+{
+	unsigned char *pos;
+	const unsigned char *end, *in, *table;
+	size_t done;
+	int line_len, url, wrap;
+	base64_encode_kernel kernel = base64_select_encode();
+
+	url = (flags & BASE64_URL_SAFE) != 0;
+	wrap = !(flags & (BASE64_URL_SAFE | BASE64_NO_WRAP));
+	table = url ? base64_url_table : base64_table;
 
 	end = src + len;
 	in = src;
 	pos = out;
 	line_len = 0;
 	while (end - in >= 3) {
-		*pos++ = base64_table[in[0] >> 2];
-		*pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
-		*pos++ = base64_table[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
-		*pos++ = base64_table[in[2] & 0x3f];
+		/* Lines are 72 characters, 54 input bytes */
+		if (kernel != NULL && line_len == 0 && end - in >= 54 &&
+		    (done = kernel(in, wrap ? 54 : end - in, end - in, pos, url)) > 0) {
+			in += done;
+			pos += done / 3 * 4;
+			if (wrap)
+				line_len += done / 3 * 4;
+			continue;
+		}
+		*pos++ = table[in[0] >> 2];
+		*pos++ = table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+		*pos++ = table[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+		*pos++ = table[in[2] & 0x3f];
 		in += 3;
+		if (!wrap)
+			continue;
 		line_len += 4;
 		if (line_len >= 72) {
 			*pos++ = '\n';
@@ -62,68 +425,106 @@ unsigned char * base64_encode(const unsigned char *src, size_t len,
 	}
 
 	if (end - in) {
-		*pos++ = base64_table[in[0] >> 2];
+		*pos++ = table[in[0] >> 2];
 		if (end - in == 1) {
-			*pos++ = base64_table[(in[0] & 0x03) << 4];
-			*pos++ = '=';
+			*pos++ = table[(in[0] & 0x03) << 4];
+			if (!url)
+				*pos++ = '=';
 		} else {
-			*pos++ = base64_table[((in[0] & 0x03) << 4) |
-					      (in[1] >> 4)];
-			*pos++ = base64_table[(in[1] & 0x0f) << 2];
+			*pos++ = table[((in[0] & 0x03) << 4) |
+				       (in[1] >> 4)];
+			*pos++ = table[(in[1] & 0x0f) << 2];
 		}
-		*pos++ = '=';
-		line_len += 4;
+		if (!url)
+			*pos++ = '=';
+		if (wrap)
+			line_len += 4;
 	}
 
 	if (line_len)
 		*pos++ = '\n';
 
 	*pos = '\0';
-	if (out_len)
-		*out_len = pos - out;
-	return out;
+	return pos - out;
 }
 
-
 /**
- * base64_decode - Base64 decode
- * @src: Data to be decoded
- * @len: Length of the data to be decoded
- * @out_len: Pointer to output length variable
- * Returns: Allocated buffer of out_len bytes of decoded data,
+ * base64_encode - Base64 encode
+ * @src: Data to be encoded
+ * @len: Length of the data to be encoded
+ * @out_len: Pointer to output length variable, or %NULL if not used
+ * Returns: Allocated buffer of out_len bytes of encoded data,
  * or %NULL on failure
  *
- * Caller is responsible for freeing the returned buffer.
+ * Caller is responsible for freeing the returned buffer. Returned buffer is
+ * nul terminated to make it easier to use as a C string. The nul terminator is
+ * not included in out_len.
  */
-unsigned char * base64_decode(const unsigned char *src, size_t len,
+unsigned char * base64_encode(const unsigned char *src, size_t len,
 			      size_t *out_len)
 {
-	unsigned char dtable[256], *out, *pos, block[4], tmp;
-	size_t i, count, olen;
-	int pad = 0;
+	unsigned char *out;
+	size_t olen, elen;
 
-	memset(dtable, 0x80, 256);
-	for (i = 0; i < sizeof(base64_table) - 1; i++)
-		dtable[base64_table[i]] = (unsigned char) i;
-	dtable['='] = 0;
+	olen = base64_encode_bound(len, 0);
+	if (olen < len)
+		return NULL; /* integer overflow */
+	out = malloc(olen);
+	if (out == NULL)
+		return NULL;
 
-	count = 0;
-	for (i = 0; i < len; i++) {
-		if (dtable[src[i]] != 0x80)
-			count++;
-	}
+	elen = base64_encode_into(src, len, out, 0);
+	if (out_len)
+		*out_len = elen;
+	return out;
+}
 
-	if (count == 0 || count % 4)
-		return NULL;
 
-	olen = count / 4 * 3;
-	pos = out = malloc(olen);
-	if (out == NULL)
-		return NULL;
+/**
+ * base64_decode_bound - Size of the buffer base64_decode_into needs
+ * @len: Length of the data to be decoded
+ * Returns: Number of bytes
+ */
+size_t base64_decode_bound(size_t len)
+{
+	/* Worst case, an unpadded tail, and room for the full-width stores of
+	 * the vector kernels. */
+	return len / 4 * 3 + 3 + 32;
+}
 
+/**
+ * base64_decode_into - Base64 decode into a caller buffer
+ * @src: Data to be decoded
+ * @len: Length of the data to be decoded
+ * @out: Buffer of at least base64_decode_bound(len) bytes
+ * @out_len: Pointer to output length variable
+ * @flags: BASE64_URL_SAFE to also accept '-', '_' and a missing padding
+ * Returns: 0 on success, -1 on invalid data
+ */
+int base64_decode_into(const unsigned char *src, size_t len,
+		       unsigned char *out, size_t *out_len, int flags)
+{
+	unsigned char *pos, block[4], tmp;
+	size_t i, count, total, done;
+	int pad = 0, url = (flags & BASE64_URL_SAFE) != 0;
+	base64_decode_kernel kernel = base64_select_decode();
+
+	pos = out;
 	count = 0;
+	total = 0;
 	for (i = 0; i < len; i++) {
-		tmp = dtable[src[i]];
+		if (kernel != NULL && count == 0) {
+			done = kernel(src + i, len - i, pos);
+			i += done;
+			pos += done / 4 * 3;
+			total += done;
+			if (i == len)
+				break;
+		}
+
+		tmp = base64_dtable[src[i]];
+		if (tmp == 0x80 && url)
+			tmp = src[i] == '-' ? 62 : src[i] == '_' ? 63 : 0x80;
 		if (tmp == 0x80)
 			continue;
 
@@ -131,6 +532,7 @@ unsigned char * base64_decode(const unsigned char *src, size_t len,
 			pad++;
 		block[count] = tmp;
 		count++;
+		total++;
 		if (count == 4) {
 			*pos++ = (block[0] << 2) | (block[1] >> 4);
 			*pos++ = (block[1] << 4) | (block[2] >> 2);
@@ -143,14 +545,56 @@ unsigned char * base64_decode(const unsigned char *src, size_t len,
 					pos -= 2;
 				else {
 					/* Invalid padding */
-					free(out);
-					return NULL;
+					return -1;
 				}
 				break;
 			}
 		}
 	}
 
+	/* Characters after the padding still count towards the length */
+	for (i++; i < len; i++) {
+		if (base64_dtable[src[i]] != 0x80)
+			total++;
+	}
+
+	/* URL-safe data usually comes without padding */
+	if (url && count >= 2 && !pad) {
+		*pos++ = (block[0] << 2) | (block[1] >> 4);
+		if (count == 3)
+			*pos++ = (block[1] << 4) | (block[2] >> 2);
+		total += 4 - count;
+	}
+
+	if (total == 0 || total % 4)
+		return -1;
+
 	*out_len = pos - out;
+	return 0;
+}
+
+/**
+ * base64_decode - Base64 decode
+ * @src: Data to be decoded
+ * @len: Length of the data to be decoded
+ * @out_len: Pointer to output length variable
+ * Returns: Allocated buffer of out_len bytes of decoded data,
+ * or %NULL on failure
+ *
+ * Caller is responsible for freeing the returned buffer.
+ */
+unsigned char * base64_decode(const unsigned char *src, size_t len,
+			      size_t *out_len)
+{
+	unsigned char *out;
+
+	out = malloc(base64_decode_bound(len));
+	if (out == NULL)
+		return NULL;
+
+	if (base64_decode_into(src, len, out, out_len, 0) != 0) {
+		free(out);
+		return NULL;
+	}
 	return out;
-}
\ No newline at end of file
+}
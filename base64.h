@@ -11,9 +11,20 @@
 #ifndef BASE64_H
 #define BASE64_H
 
+/* Flags of base64_encode_into/base64_decode_into */
+#define BASE64_URL_SAFE 1 /* '-' and '_' for '+' and '/', no padding nor line feeds */
+#define BASE64_NO_WRAP  2 /* no line feed every 72 characters */
+
 unsigned char * base64_encode(const unsigned char *src, size_t len,
 			      size_t *out_len);
 unsigned char * base64_decode(const unsigned char *src, size_t len,
 			      size_t *out_len);
 
+size_t base64_encode_bound(size_t len, int flags);
+size_t base64_encode_into(const unsigned char *src, size_t len,
+			  unsigned char *out, int flags);
+size_t base64_decode_bound(size_t len);
+int base64_decode_into(const unsigned char *src, size_t len,
+		       unsigned char *out, size_t *out_len, int flags);
+
 #endif /* BASE64_H */
\ No newline at end of file
@@ -8,6 +8,7 @@
  * You may select, at your option, one of the above-listed licenses.
  */
 
+#define ZSTD_STATIC_LINKING_ONLY
 #include <zstd.h>
 #include "base64.h"
 #include "kong_zstd.h"
@@ -26,191 +27,1932 @@ void DisableDebug()
 
 void AddDict(GoString name, GoString filename)
 {
-    if (globalCDicts.len >= dictLen || globalDDicts.len >= dictLen)
+    AddDictWithLevel(name, filename, 3);
+}
+
+void AddDictWithLevel(GoString name, GoString filename, GoInt level)
+{
+    if (find_dict(name) != NULL)
+    {
+        /* error */
+        LOGF("[AddDict] %s : dict already exists", name.p);
+        return;
+    }
+
+    LOGF("[INFO] add dict(%s) with %s at level %lld ...", name.p, filename.p, level);
+
+    GoDict* const entry = createDictFromFile_orDie(name, filename.p, (int)level, 0);
+    if (entry == NULL)
+    {
+        /* error */
+        LOGF("[AddDict] %s : invalid dict file %s", name.p, filename.p);
+        return;
+    }
+
+    store_dict(entry);
+}
+
+GoInt AddDictFromMemory(GoString name, void* dict, GoInt dictSize, GoInt isBase64)
+{
+    if (CHECK(name.n > 0 && dict != NULL && dictSize > 0, "invalid dict: key=%.*s", (int)name.n, name.p) != 0)
+    {
+        return -1;
+    }
+    if (CHECK(find_dict(name) == NULL, "dict already exists: key=%.*s", (int)name.n, name.p) != 0)
+    {
+        return -1;
+    }
+
+    LOGF("[INFO] add dict(%.*s) from memory, size=%lld ...", (int)name.n, name.p, dictSize);
+
+    GoDict* const entry = createDict(name, dict, (size_t)dictSize, isBase64 != 0, 3, 0);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+
+    store_dict(entry);
+
+    return 0;
+}
+
+GoInt ReplaceDict(GoString name, GoString filename)
+{
+    struct stat st;
+    if (CHECK(stat(filename.p, &st) == 0, "cannot stat dict file: %s", filename.p) != 0)
+    {
+        return -1;
+    }
+
+    GoDict* const old = find_dict(name);
+    if (old == NULL)
+    {
+        AddDict(name, filename);
+
+        return 0;
+    }
+
+    LOGF("[INFO] replace dict(%s) with %s ...", name.p, filename.p);
+
+    GoDict* const entry = createDictFromFile_orDie(name, filename.p, old->level, 0);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+
+    swap_dict(old, entry);
+
+    return 0;
+}
+
+GoInt TrainDict(GoString name, void* samples, size_t* sampleSizes, GoInt n, GoInt dictCapacity, GoTrainParams params)
+{
+    if (CHECK(name.n > 0 && samples != NULL && sampleSizes != NULL && n > 0 && dictCapacity > 0,
+              "invalid train dict: key=%.*s", (int)name.n, name.p) != 0)
+    {
+        return -1;
+    }
+
+    LOGF("[INFO] train dict(%.*s) from %lld samples, capacity=%lld ...", (int)name.n, name.p, n, dictCapacity);
+
+    /* Copy everything the thread reads, the caller may free it on return */
+    size_t samplesSize = 0;
+    GoInt i;
+    for (i = 0; i < n; i++)
+    {
+        samplesSize += sampleSizes[i];
+    }
+
+    GoTrainJob* const job = malloc_orDie(sizeof(GoTrainJob));
+    char* const key = malloc_orDie(name.n);
+    memcpy(key, name.p, name.n);
+    job->name.p = key;
+    job->name.n = name.n;
+    job->params = params;
+    job->samples = malloc_orDie(samplesSize > 0 ? samplesSize : 1);
+    memcpy(job->samples, samples, samplesSize);
+    job->sampleSizes = malloc_orDie((size_t)n * sizeof(size_t));
+    memcpy(job->sampleSizes, sampleSizes, (size_t)n * sizeof(size_t));
+    job->n = (unsigned)n;
+    job->dict = malloc_orDie((size_t)dictCapacity);
+    job->dictSize = (size_t)dictCapacity;
+    job->next = NULL;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_lock(&trainLock);
+    pthread_t thread;
+    int const err = pthread_create(&thread, &attr, train_dict, job);
+    if (err == 0)
+    {
+        trainRunning++;
+    }
+    pthread_mutex_unlock(&trainLock);
+    pthread_attr_destroy(&attr);
+
+    if (CHECK(err == 0, "cannot start training thread: %s", strerror(err)) != 0)
+    {
+        free(job->samples);
+        free(job->sampleSizes);
+        free(job->dict);
+        free(key);
+        free(job);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+GoInt InstallTrainedDicts()
+{
+    return install_trained_dicts();
+}
+
+GoInt WaitTrainDicts()
+{
+    pthread_mutex_lock(&trainLock);
+    while (trainRunning > 0)
+    {
+        pthread_cond_wait(&trainCond, &trainLock);
+    }
+    pthread_mutex_unlock(&trainLock);
+
+    return install_trained_dicts();
+}
+
+void EnableSampling(GoInt maxSamples, GoInt maxSampleSize, GoInt memoryCap)
+{
+    DisableSampling();
+
+    if (CHECK(maxSamples > 0 && maxSampleSize > 0 && memoryCap > 0, "invalid sampling: maxSamples=%lld, maxSampleSize=%lld, memoryCap=%lld",
+              maxSamples, maxSampleSize, memoryCap) != 0)
+    {
+        return;
+    }
+
+    LOGF("[INFO] enable sampling: maxSamples=%lld, maxSampleSize=%lld, memoryCap=%lld ...", maxSamples, maxSampleSize, memoryCap);
+
+    pthread_mutex_lock(&samplerLock);
+    sampler.maxSamples = (int)maxSamples;
+    sampler.maxSampleSize = (size_t)maxSampleSize;
+    sampler.cap = (size_t)memoryCap;
+    sampler.used = 0;
+    sampler.rand = (GoUint64)time(NULL) | 1;
+    __atomic_store_n(&sampler.enabled, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&samplerLock);
+}
+
+void DisableSampling()
+{
+    pthread_mutex_lock(&samplerLock);
+    __atomic_store_n(&sampler.enabled, 0, __ATOMIC_RELEASE);
+
+    GoReservoir* reservoir = sampler.reservoirs;
+    while (reservoir != NULL)
+    {
+        GoReservoir* const next = reservoir->next;
+
+        int i;
+        for (i = 0; i < reservoir->len; i++)
+        {
+            free(reservoir->samples[i].data);
+        }
+        free(reservoir->samples);
+        free(reservoir->key);
+        free(reservoir);
+
+        reservoir = next;
+    }
+    sampler.reservoirs = NULL;
+    sampler.used = 0;
+    pthread_mutex_unlock(&samplerLock);
+}
+
+GoInt GetSamples(GoString key, GoBatchArena* arena, size_t* sampleSizes, GoInt maxN)
+{
+    if (CHECK(arena != NULL && sampleSizes != NULL && maxN >= 0, "invalid samples arena") != 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&samplerLock);
+    GoReservoir* const reservoir = load_reservoir(key, 0);
+
+    GoInt n = 0;
+    arena->size = 0;
+    for (; reservoir != NULL && n < reservoir->len && n < maxN; n++)
+    {
+        GoSample const* const sample = &reservoir->samples[n];
+
+        void* const dst = reserve_arena(arena, sample->size);
+        if (dst == NULL)
+        {
+            break;
+        }
+        memcpy(dst, sample->data, sample->size);
+        arena->size += (GoInt)sample->size;
+        sampleSizes[n] = sample->size;
+    }
+    pthread_mutex_unlock(&samplerLock);
+
+    return n;
+}
+
+GoInt WriteSamples(GoString key, GoString dir)
+{
+    if (CHECK(mkdir(dir.p, 0755) == 0 || errno == EEXIST, "cannot create samples dir %s: %s", dir.p, strerror(errno)) != 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&samplerLock);
+    GoReservoir* const reservoir = load_reservoir(key, 0);
+
+    GoInt n = 0;
+    for (; reservoir != NULL && n < reservoir->len; n++)
+    {
+        char fileName[PATH_MAX];
+        snprintf(fileName, sizeof(fileName), "%s/sample-%06lld", dir.p, n);
+
+        FILE* const fout = fopen(fileName, "wb");
+        if (CHECK(fout != NULL, "cannot open sample file %s: %s", fileName, strerror(errno)) != 0)
+        {
+            n = -1;
+            break;
+        }
+
+        size_t const written = fwrite(reservoir->samples[n].data, 1, reservoir->samples[n].size, fout);
+        if (CHECK(fclose(fout) == 0 && written == reservoir->samples[n].size, "cannot write sample file %s", fileName) != 0)
+        {
+            n = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&samplerLock);
+
+    return n;
+}
+
+GoInt GetDictStats(GoString name, GoDictStats* stats)
+{
+    GoDict* const entry = load_dict(name);
+    if (CHECK(entry != NULL && stats != NULL, "cannot load dict: key=%.*s", (int)name.n, name.p) != 0)
+    {
+        release_dict(entry);
+
+        return -1;
+    }
+
+    GoDictCounters* const counters = &entry->counters;
+
+    stats->calls = __atomic_load_n(&counters->calls, __ATOMIC_RELAXED);
+    stats->bytesIn = __atomic_load_n(&counters->bytesIn, __ATOMIC_RELAXED);
+    stats->bytesOut = __atomic_load_n(&counters->bytesOut, __ATOMIC_RELAXED);
+    stats->ratio = stats->bytesOut > 0 ? (GoFloat64)stats->bytesIn / stats->bytesOut : 0;
+
+    GoUint64 const rolling = __atomic_load_n(&counters->rolling, __ATOMIC_RELAXED);
+    GoUint64 const baseline = __atomic_load_n(&counters->baseline, __ATOMIC_RELAXED);
+    GoUint64 const probeIn = __atomic_load_n(&counters->probeIn, __ATOMIC_RELAXED);
+    GoUint64 const probeOut = __atomic_load_n(&counters->probeOut, __ATOMIC_RELAXED);
+    GoUint64 const noDict = probeOut > 0 ? probeIn * 1000 / probeOut : 0;
+
+    stats->rollingRatio = rolling / 1000.0;
+    stats->baselineRatio = baseline / 1000.0;
+    stats->noDictRatio = noDict / 1000.0;
+
+    /* No verdict before the first window is complete */
+    stats->drifted = rolling > 0 && (rolling * 1000 < baseline * dictDriftTolerance || rolling <= noDict);
+
+    release_dict(entry);
+
+    return 0;
+}
+
+GoInt AddSharedDict(GoString name, GoString filename, GoInt level)
+{
+    if (CHECK(!sharedDictArena.frozen, "shared dicts are frozen: key=%s", name.p) != 0)
+    {
+        return -1;
+    }
+    if (CHECK(sharedDictArena.len == 0 || sharedDictArena.pid == getpid(),
+              "shared dicts belong to process %d: key=%s", (int)sharedDictArena.pid, name.p) != 0)
+    {
+        return -1;
+    }
+    if (CHECK(find_dict(name) == NULL, "dict already exists: key=%s", name.p) != 0)
+    {
+        return -1;
+    }
+
+    LOGF("[INFO] add shared dict(%s) with %s at level %lld ...", name.p, filename.p, level);
+
+    GoDict* const entry = createDictFromFile_orDie(name, filename.p, (int)level, 1);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+
+    store_dict(entry);
+
+    return 0;
+}
+
+GoInt FreezeSharedDicts()
+{
+    size_t total = 0;
+
+    int i;
+    for (i = 0; i < sharedDictArena.len; i++)
+    {
+        if (CHECK(mprotect(sharedDictArena.chunks[i].base, sharedDictArena.chunks[i].size, PROT_READ) == 0,
+                  "mprotect of shared dict arena failed: %s", strerror(errno)) != 0)
+        {
+            return -1;
+        }
+        total += sharedDictArena.chunks[i].size;
+    }
+    sharedDictArena.frozen = 1;
+
+    LOGF("[INFO] freeze shared dicts: chunks=%d, size=%zu ...", sharedDictArena.len, total);
+
+    return 0;
+}
+
+GoInt RemoveDict(GoString name)
+{
+    GoDict* const old = find_dict(name);
+    if (CHECK(old != NULL, "cannot load dict: key=%s", name.p) != 0)
+    {
+        return -1;
+    }
+
+    LOGF("[INFO] remove dict(%s) ...", old->key);
+
+    unstore_dict(old);
+
+    return 0;
+}
+
+void ReleaseDict()
+{
+    GoDictTable* const table = globalDicts.table;
+    if (table == NULL)
+    {
+        reclaim_dicts();
+
+        return;
+    }
+
+    __atomic_store_n(&globalDicts.table, NULL, __ATOMIC_SEQ_CST);
+
+    size_t i;
+    for (i = 0; i < table->cap; i++)
+    {
+        GoDict* const entry = table->slots[i];
+        if (entry == NULL)
+        {
+            continue;
+        }
+
+        LOGF("[INFO] release dict(%s) ...", entry->key);
+        retire_dict(entry);
+    }
+
+    table->retired = globalDicts.retiredTables;
+    globalDicts.retiredTables = table;
+    globalDicts.len = 0;
+
+    reclaim_dicts();
+}
+
+GoInt AddParams(GoString name, GoCompressParams params)
+{
+    if (CHECK(name.n > 0, "empty name of params") != 0)
+    {
+        return -1;
+    }
+    if (CHECK(load_params(name) == NULL, "params already exist: key=%s", name.p) != 0)
+    {
+        return -1;
+    }
+    if (CHECK(params.maxRatio >= 0, "invalid maxRatio of params: %lld", params.maxRatio) != 0)
+    {
+        return -1;
+    }
+
+    /* Validate once on a scratch context so that compress calls never see
+     * a rejected value, e.g. nbWorkers without ZSTD_MULTITHREAD.
+     */
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
+    {
+        return -1;
+    }
+    int const ret = apply_params(cctx, &params);
+    release_cctx(cctx);
+
+    if (ret != 0)
+    {
+        return -1;
+    }
+
+    LOGF("[INFO] add params(%.*s) with level %lld ...", (int)name.n, name.p, params.level);
+
+    GoParams* const entry = malloc_orDie(sizeof(GoParams));
+    entry->key = malloc_orDie(name.n + 1);
+    memcpy(entry->key, name.p, name.n);
+    entry->key[name.n] = '\0';
+    entry->keyLen = (size_t)name.n;
+    entry->hash = hash_key(name.p, (size_t)name.n);
+    entry->params = params;
+
+    store_params(entry);
+
+    return 0;
+}
+
+void ReleaseParams()
+{
+    GoParamsTable* table = globalParams.table;
+    if (table == NULL)
+    {
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < table->cap; i++)
+    {
+        GoParams* const entry = table->slots[i];
+        if (entry != NULL)
+        {
+            LOGF("[INFO] free params(%s) ...", entry->key);
+            free(entry->key);
+            free(entry);
+        }
+    }
+
+    while (table != NULL)
+    {
+        GoParamsTable* const retired = table->retired;
+        free(table->slots);
+        free(table);
+        table = retired;
+    }
+
+    globalParams.table = NULL;
+    globalParams.len = 0;
+}
+
+void EnableCompressCache(GoInt budget)
+{
+    DisableCompressCache();
+
+    if (budget <= 0)
+    {
+        return;
+    }
+
+    GoCacheEntry** const buckets = calloc(cacheInitCap, sizeof(GoCacheEntry*));
+    if (CHECK(buckets != NULL, "cannot allocate compress cache") != 0)
+    {
+        return;
+    }
+
+    threadCompressCache.buckets = buckets;
+    threadCompressCache.cap = cacheInitCap;
+    threadCompressCache.budget = (size_t)budget;
+
+    LOGF("[INFO] enable compress cache: budget=%lld ...", budget);
+}
+
+void DisableCompressCache()
+{
+    GoCacheEntry* entry = threadCompressCache.head;
+    while (entry != NULL)
+    {
+        GoCacheEntry* const next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    free(threadCompressCache.buckets);
+
+    threadCompressCache.buckets = NULL;
+    threadCompressCache.cap = 0;
+    threadCompressCache.budget = 0;
+    threadCompressCache.head = NULL;
+    threadCompressCache.tail = NULL;
+    threadCompressCache.stats.entries = 0;
+    threadCompressCache.stats.bytes = 0;
+}
+
+struct GoCompressCacheStats GetCompressCacheStats()
+{
+    return threadCompressCache.stats;
+}
+
+void EnableCompressProbe(GoInt minGain)
+{
+    __atomic_store_n(&probeMinGain, minGain > 1000 ? 1000 : minGain, __ATOMIC_RELAXED);
+
+    LOGF("[INFO] enable compress probe: minGain=%lld ...", minGain);
+}
+
+void DisableCompressProbe()
+{
+    __atomic_store_n(&probeMinGain, 0, __ATOMIC_RELAXED);
+}
+
+GoInt ProbeCompressible(GoString gs)
+{
+    if (CHECK(gs.n >= 0, "invalid data for compress probe") != 0)
+    {
+        return -1;
+    }
+
+    return probe_gain(gs.p, (size_t)gs.n);
+}
+
+void GetStats(GoStats* stats)
+{
+    *stats = threadStats;
+    stats->cctxAllocs = threadCtxPool.stats.cctxMisses;
+    stats->dctxAllocs = threadCtxPool.stats.dctxMisses;
+}
+
+struct GoCtxPoolStats GetCtxPoolStats()
+{
+    return threadCtxPool.stats;
+}
+
+void ReleaseCtxPool()
+{
+    while (threadCtxPool.cctxLen > 0)
+    {
+        ZSTD_freeCCtx(threadCtxPool.cctxs[--threadCtxPool.cctxLen]);
+    }
+
+    while (threadCtxPool.dctxLen > 0)
+    {
+        ZSTD_freeDCtx(threadCtxPool.dctxs[--threadCtxPool.dctxLen]);
+    }
+
+    free(threadBase64Scratch.data);
+    threadBase64Scratch.data = NULL;
+    threadBase64Scratch.cap = 0;
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] release ctx pool: cctx hits=%llu, misses=%llu, dctx hits=%llu, misses=%llu",
+             threadCtxPool.stats.cctxHits, threadCtxPool.stats.cctxMisses,
+             threadCtxPool.stats.dctxHits, threadCtxPool.stats.dctxMisses);
+    }
+}
+
+struct GoCompressResult Compress(GoString gs)
+{
+    GoCompressResult result = {NULL, -1};
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd compress: data=%s, size=%zu", gs.p, gs.n);
+    }
+    size_t rSize = (size_t)gs.n;
+    void* const rBuff = (void* const)gs.p;
+
+    if (__atomic_load_n(&sampler.enabled, __ATOMIC_RELAXED))
+    {
+        GoString const noKey = {"", 0};
+        sample_input(noKey, gs);
+    }
+
+    if (probe_skip(gs))
+    {
+        result.size = 0;
+
+        return stats_compress(start, gs, result);
+    }
+
+    GoUint64 hash = 0;
+    if (threadCompressCache.budget > 0 && cache_get(gs, 3, 0, &hash, &result))
+    {
+        return stats_compress(start, gs, result);
+    }
+
+    /* Compress */
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
+    {
+        return stats_compress(start, gs, result);
+    }
+
+    size_t const cBuffSize = ZSTD_compressBound(rSize);
+    void* const cBuff = malloc_orDie(cBuffSize);
+
+    size_t const cSize = ZSTD_compressCCtx(cctx, cBuff, cBuffSize, rBuff, rSize, 3);
+    release_cctx(cctx);
+
+    if (CHECK_ZSTD(cSize, "invalid compress size of zstd") != 0)
+    {
+        free(cBuff);
+
+        return stats_compress(start, gs, result);
+    }
+
+    if (threadCompressCache.budget > 0)
+    {
+        cache_put(hash, rSize, 3, 0, cBuff, cSize);
+    }
+
+    result.data = cBuff;
+    result.size = cSize;
+
+    return stats_compress(start, gs, result);
+}
+
+struct GoDecompressResult Decompress(GoString gs)
+{
+    GoDecompressResult result = { NULL, -1 };
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress: data=%s, size=%zu", gs.p, gs.n);
+    }
+    size_t cSize = (size_t)gs.n;
+    void* const cBuff = (void* const)gs.p;
+
+    /* Read the content size from the frame header. For simplicity we require
+     * that it is always present. By default, zstd will write the content size
+     * in the header when it is known. If you can't guarantee that the frame
+     * content size is always written into the header, either use streaming
+     * decompression, or ZSTD_decompressBound().
+     */
+    unsigned long long const rSize = ZSTD_getFrameContentSize(cBuff, cSize);
+    if (CHECK(rSize != ZSTD_CONTENTSIZE_ERROR, "invalid compressed data of zstd") != 0)
+    {
+        return stats_decompress(start, gs, result);
+    }
+    if (CHECK(rSize != ZSTD_CONTENTSIZE_UNKNOWN, "original size is unknown for zstd") != 0)
+    {
+        threadStats.streamFallbacks++;
+
+        return stats_decompress(start, gs, stream_decompress(gs, NULL));
+    }
+
+
+    /* Decompress with a pooled context, reused across calls. */
+    ZSTD_DCtx* const dctx = acquire_dctx();
+    if (dctx == NULL)
+    {
+        return stats_decompress(start, gs, result);
+    }
+
+    void* const rBuff = malloc_orDie((size_t)rSize);
+
+    size_t const dSize = ZSTD_decompressDCtx(dctx, rBuff, rSize, cBuff, cSize);
+    release_dctx(dctx);
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress: data=%s, size=%zu, rsize=%llu, dsize=%zu", gs.p, gs.n, rSize, dSize);
+    }
+    if (CHECK_ZSTD(dSize, "invalid decompress size of zstd") != 0)
+    {
+        free(rBuff);
+
+        return stats_decompress(start, gs, result);
+    }
+
+    /* When zstd knows the content size, it will error if it doesn't match. */
+    if (CHECK(dSize == rSize, "Impossible because zstd will check this condition!") != 0)
+    {
+        free(rBuff);
+
+        return stats_decompress(start, gs, result);
+    }
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress: result=%s, rsize=%llu, dsize=%zu", (char *)rBuff, rSize, dSize);
+    }
+    result.data = rBuff;
+    result.size = rSize;
+
+    return stats_decompress(start, gs, result);
+}
+
+struct GoCompressResult CompressWithParams(GoString gs, GoString params)
+{
+    GoString dict = { NULL, -1 };
+
+    return CompressWithDictAndParams(gs, dict, params);
+}
+
+struct GoCompressResult CompressWithDictAndParams(GoString gs, GoString dict, GoString params)
+{
+    GoCompressResult result = {NULL, -1};
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd compress with params: key=%s, params=%s, data=%s, size=%zu", dict.p, params.p, gs.p, gs.n);
+    }
+    GoCompressParams* const cparams = load_params(params);
+    if (CHECK(cparams != NULL, "cannot load params: key=%s", params.p) != 0)
+    {
+        return stats_compress(start, gs, result);
+    }
+
+    size_t rSize = (size_t)gs.n;
+    void* const rBuff = (void* const)gs.p;
+
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
+    {
+        return stats_compress(start, gs, result);
+    }
+
+    if (apply_params(cctx, cparams) != 0)
+    {
+        release_cctx(cctx);
+
+        return stats_compress(start, gs, result);
+    }
+
+    /* Apply dict if supplied. The CDict keeps the level it was built with,
+     * only frame parameters such as checksumFlag still apply on top of it.
+     */
+    GoDict* entry = NULL;
+    if (dict.n > 0)
+    {
+        entry = load_dict(dict);
+        if (CHECK(entry != NULL, "cannot load cdict: key=%s", dict.p) != 0)
+        {
+            release_cctx(cctx);
+
+            return stats_compress(start, gs, result);
+        }
+
+        size_t const dret = ZSTD_CCtx_refCDict(cctx, entry->cdict);
+        if (CHECK_ZSTD(dret, "cannot init dict for compress") != 0)
+        {
+            release_cctx(cctx);
+            release_dict(entry);
+
+            return stats_compress(start, gs, result);
+        }
+    }
+
+    /* With maxRatio, a frame larger than the ratio allows is never kept */
+    size_t cBuffSize = ZSTD_compressBound(rSize);
+    if (cparams->maxRatio > 0 && (GoUint64)rSize * (GoUint64)cparams->maxRatio / 1000 < cBuffSize)
+    {
+        cBuffSize = (size_t)((GoUint64)rSize * (GoUint64)cparams->maxRatio / 1000) + 1;
+    }
+    void* const cBuff = malloc_orDie(cBuffSize);
+
+    size_t const cSize = cparams->maxRatio > 0
+        ? compress_bounded(cctx, cBuff, cBuffSize, rBuff, rSize, cparams->maxRatio)
+        : ZSTD_compress2(cctx, cBuff, cBuffSize, rBuff, rSize);
+    release_cctx(cctx);
+
+    if (entry != NULL && !ZSTD_isError(cSize) && cSize > 0)
+    {
+        record_dict_stats(entry, NULL, rBuff, rSize, cSize);
+    }
+    release_dict(entry);
+
+    if (CHECK_ZSTD(cSize, "invalid compress size of zstd with params") != 0)
+    {
+        free(cBuff);
+
+        return stats_compress(start, gs, result);
+    }
+
+    if (cSize == 0)
+    {
+        free(cBuff);
+        threadStats.skipped++;
+
+        if (isDebug == 1)
+        {
+            LOGF("[DEBUG] zstd compress with params gave up: maxRatio=%lld, size=%zu", cparams->maxRatio, rSize);
+        }
+        result.size = 0;
+
+        return stats_compress(start, gs, result);
+    }
+
+    result.data = cBuff;
+    result.size = cSize;
+
+    return stats_compress(start, gs, result);
+}
+
+struct GoCompressResult CompressMT(GoString gs, GoString params)
+{
+    GoCompressResult result = {NULL, -1};
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd compress mt: params=%s, data=%s, size=%zu", params.p, gs.p, gs.n);
+    }
+    GoCompressParams cparams = { 3, 0, 0, 0, 1, mtDefaultWorkers, 0, 0 };
+    if (params.n > 0)
+    {
+        GoCompressParams* const named = load_params(params);
+        if (CHECK(named != NULL, "cannot load params: key=%s", params.p) != 0)
+        {
+            return stats_compress(start, gs, result);
+        }
+        cparams = *named;
+    }
+
+    size_t rSize = (size_t)gs.n;
+    void* const rBuff = (void* const)gs.p;
+
+    /* Use the shared context unless another thread is compressing with it,
+     * in which case a pooled context compresses single-threaded rather than
+     * waiting for the lock. Without workers there is nothing to share.
+     */
+    ZSTD_CCtx* cctx = NULL;
+    int const shared = cparams.nbWorkers > 0 && pthread_mutex_trylock(&mtCCtxLock) == 0;
+    if (shared)
+    {
+        if (mtCCtx == NULL)
+        {
+            mtCCtx = ZSTD_createCCtx();
+        }
+        cctx = mtCCtx;
+    }
+    else
+    {
+        cparams.nbWorkers = 0;
+        cparams.jobSize = 0;
+        cctx = acquire_cctx();
+    }
+
+    size_t cSize = 0;
+    void* cBuff = NULL;
+    if (CHECK(cctx != NULL, "ZSTD_createCCtx() failed!") == 0 &&
+        CHECK_ZSTD(ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters)) == 0 &&
+        apply_params(cctx, &cparams) == 0)
+    {
+        size_t const cBuffSize = ZSTD_compressBound(rSize);
+        cBuff = malloc_orDie(cBuffSize);
+
+        cSize = ZSTD_compress2(cctx, cBuff, cBuffSize, rBuff, rSize);
+    }
+    else
+    {
+        cSize = (size_t)-1;
+    }
+
+    if (shared)
+    {
+        pthread_mutex_unlock(&mtCCtxLock);
+    }
+    else
+    {
+        release_cctx(cctx);
+    }
+
+    if (cBuff == NULL || CHECK_ZSTD(cSize, "invalid compress size of zstd mt") != 0)
+    {
+        free(cBuff);
+
+        return stats_compress(start, gs, result);
+    }
+
+    result.data = cBuff;
+    result.size = cSize;
+
+    return stats_compress(start, gs, result);
+}
+
+struct GoCompressResult CompressSeekable(GoString gs, GoInt frameSize)
+{
+    GoCompressResult result = {NULL, -1};
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd compress seekable: frame=%lld, data=%s, size=%zu", frameSize, gs.p, gs.n);
+    }
+    if (CHECK(frameSize > 0 && frameSize <= ZSTD_SEEKABLE_MAX_FRAME_DECOMPRESSED_SIZE, "invalid frame size: %lld", frameSize) != 0)
+    {
+        return stats_compress(start, gs, result);
+    }
+
+    ZSTD_seekable_CStream* const zcs = ZSTD_seekable_createCStream();
+    if (CHECK(zcs != NULL, "ZSTD_seekable_createCStream() failed!") != 0)
+    {
+        return stats_compress(start, gs, result);
+    }
+
+    size_t const iret = ZSTD_seekable_initCStream(zcs, 3, 1, (unsigned)frameSize);
+    if (CHECK_ZSTD(iret, "cannot init seekable compress") != 0)
+    {
+        ZSTD_seekable_freeCStream(zcs);
+
+        return stats_compress(start, gs, result);
+    }
+
+    size_t rSize = (size_t)gs.n;
+
+    /* Every frame and the seek table add a few bytes on top of the bound. */
+    size_t cBuffSize = ZSTD_compressBound(rSize) + ZSTD_CStreamOutSize();
+    void* cBuff = malloc_orDie(cBuffSize);
+
+    ZSTD_inBuffer input = { gs.p, rSize, 0 };
+    ZSTD_outBuffer output = { cBuff, cBuffSize, 0 };
+
+    /* Feed the whole input, then drain the last frame and the seek table. */
+    size_t remaining = 1;
+    while (input.pos < input.size || remaining != 0) {
+        if (output.pos == output.size)
+        {
+            cBuffSize *= 2;
+            cBuff = realloc_orDie(cBuff, cBuffSize);
+
+            output.dst = cBuff;
+            output.size = cBuffSize;
+        }
+
+        remaining = input.pos < input.size
+            ? ZSTD_seekable_compressStream(zcs, &output, &input)
+            : ZSTD_seekable_endStream(zcs, &output);
+        if (CHECK_ZSTD(remaining, "invalid seekable compress of zstd") != 0)
+        {
+            free(cBuff);
+            ZSTD_seekable_freeCStream(zcs);
+
+            return stats_compress(start, gs, result);
+        }
+        if (input.pos < input.size)
+        {
+            remaining = 1;
+        }
+    }
+
+    ZSTD_seekable_freeCStream(zcs);
+
+    result.data = cBuff;
+    result.size = output.pos;
+
+    return stats_compress(start, gs, result);
+}
+
+struct GoDecompressResult DecompressRange(GoString gs, GoInt offset, GoInt length)
+{
+    GoDecompressResult result = { NULL, -1 };
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress range: offset=%lld, length=%lld, size=%zu", offset, length, gs.n);
+    }
+    if (CHECK(offset >= 0 && length >= 0, "invalid range: offset=%lld, length=%lld", offset, length) != 0)
+    {
+        return stats_decompress(start, gs, result);
+    }
+
+    /* A ZSTD_seekable cannot be re-initialized without leaking its previous
+     * seek table, so the reader is not pooled.
+     */
+    ZSTD_seekable* const zs = ZSTD_seekable_create();
+    if (CHECK(zs != NULL, "ZSTD_seekable_create() failed!") != 0)
+    {
+        return stats_decompress(start, gs, result);
+    }
+
+    size_t const iret = ZSTD_seekable_initBuff(zs, gs.p, (size_t)gs.n);
+    if (CHECK_ZSTD(iret, "invalid seek table of zstd") != 0)
+    {
+        ZSTD_seekable_free(zs);
+
+        return stats_decompress(start, gs, result);
+    }
+
+    unsigned const frames = ZSTD_seekable_getNumFrames(zs);
+    unsigned long long const total = frames == 0 ? 0
+        : ZSTD_seekable_getFrameDecompressedOffset(zs, frames - 1) + ZSTD_seekable_getFrameDecompressedSize(zs, frames - 1);
+
+    unsigned long long const first = (unsigned long long)offset < total ? (unsigned long long)offset : total;
+    size_t const rSize = (size_t)((unsigned long long)length < total - first ? (unsigned long long)length : total - first);
+
+    void* const rBuff = malloc_orDie(rSize > 0 ? rSize : 1);
+
+    if (rSize > 0)
+    {
+        size_t const dSize = ZSTD_seekable_decompress(zs, rBuff, rSize, first);
+        if (CHECK_ZSTD(dSize, "invalid range decompress of zstd") != 0)
+        {
+            free(rBuff);
+            ZSTD_seekable_free(zs);
+
+            return stats_decompress(start, gs, result);
+        }
+    }
+
+    ZSTD_seekable_free(zs);
+
+    result.data = rBuff;
+    result.size = rSize;
+
+    return stats_decompress(start, gs, result);
+}
+
+GoInt CompressBatch(GoString* srcs, GoInt n, GoString dict, GoBatchArena* arena, GoInt* offsets)
+{
+    if (CHECK(srcs != NULL && n >= 0 && arena != NULL && offsets != NULL, "invalid batch for compress") != 0)
+    {
+        return -1;
+    }
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd compress batch: key=%s, n=%lld", dict.p, n);
+    }
+    GoDict* entry = NULL;
+    ZSTD_CDict* cdict = NULL;
+    if (dict.n > 0)
+    {
+        entry = load_dict(dict);
+        cdict = entry != NULL ? entry->cdict : NULL;
+        if (CHECK(cdict != NULL, "cannot load cdict: key=%s", dict.p) != 0)
+        {
+            return -1;
+        }
+    }
+
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
+    {
+        release_dict(entry);
+
+        return -1;
+    }
+
+    GoInt failed = 0;
+    arena->size = 0;
+
+    GoInt i;
+    for (i = 0; i < n; i++)
+    {
+        offsets[i] = arena->size;
+        GoUint64 const start = stats_now();
+
+        size_t const rSize = (size_t)srcs[i].n;
+        size_t const cBuffSize = ZSTD_compressBound(rSize);
+        void* const cBuff = reserve_arena(arena, cBuffSize);
+        if (cBuff == NULL)
+        {
+            stats_record(&threadStats.compress, start, srcs[i].n, -1);
+            failed++;
+
+            continue;
+        }
+
+        size_t const cSize = cdict != NULL
+            ? ZSTD_compress_usingCDict(cctx, cBuff, cBuffSize, srcs[i].p, rSize, cdict)
+            : ZSTD_compressCCtx(cctx, cBuff, cBuffSize, srcs[i].p, rSize, 3);
+        if (CHECK_ZSTD(cSize, "invalid compress size of zstd in batch") != 0)
+        {
+            stats_record(&threadStats.compress, start, srcs[i].n, -1);
+            failed++;
+
+            continue;
+        }
+
+        if (entry != NULL)
+        {
+            record_dict_stats(entry, cctx, srcs[i].p, rSize, cSize);
+        }
+        stats_record(&threadStats.compress, start, srcs[i].n, (GoInt)cSize);
+        arena->size += (GoInt)cSize;
+    }
+    offsets[n] = arena->size;
+
+    release_cctx(cctx);
+    release_dict(entry);
+
+    return failed;
+}
+
+GoInt DecompressBatch(GoString* srcs, GoInt n, GoString dict, GoBatchArena* arena, GoInt* offsets)
+{
+    if (CHECK(srcs != NULL && n >= 0 && arena != NULL && offsets != NULL, "invalid batch for decompress") != 0)
+    {
+        return -1;
+    }
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress batch: key=%s, n=%lld", dict.p, n);
+    }
+    GoDict* entry = NULL;
+    ZSTD_DDict* ddict = NULL;
+    if (dict.n > 0)
+    {
+        entry = load_dict(dict);
+        ddict = entry != NULL ? entry->ddict : NULL;
+        if (CHECK(ddict != NULL, "cannot load ddict: key=%s", dict.p) != 0)
+        {
+            return -1;
+        }
+    }
+
+    ZSTD_DCtx* const dctx = acquire_dctx();
+    if (dctx == NULL)
+    {
+        release_dict(entry);
+
+        return -1;
+    }
+
+    if (ddict != NULL)
+    {
+        size_t const dret = ZSTD_DCtx_refDDict(dctx, ddict);
+        if (CHECK_ZSTD(dret, "cannot init dict for batch decompress") != 0)
+        {
+            release_dctx(dctx);
+            release_dict(entry);
+
+            return -1;
+        }
+    }
+
+    GoInt failed = 0;
+    arena->size = 0;
+
+    GoInt i;
+    for (i = 0; i < n; i++)
+    {
+        offsets[i] = arena->size;
+        GoUint64 const start = stats_now();
+
+        size_t const cSize = (size_t)srcs[i].n;
+        const void* const cBuff = srcs[i].p;
+
+        unsigned long long const rSize = ZSTD_getFrameContentSize(cBuff, cSize);
+        if (CHECK(rSize != ZSTD_CONTENTSIZE_ERROR, "invalid compressed data of zstd in batch") != 0)
+        {
+            stats_record(&threadStats.decompress, start, srcs[i].n, -1);
+            failed++;
+
+            continue;
+        }
+
+        /* The content size comes from the frame header and is not trusted
+         * beyond streamHintMax: larger or missing sizes are streamed into the
+         * arena, which then only grows with the output actually produced,
+         * and a declared size must match that output.
+         */
+        size_t dSize;
+        if (rSize == ZSTD_CONTENTSIZE_UNKNOWN || rSize > streamHintMax)
+        {
+            dSize = stream_decompress_arena(dctx, arena, cBuff, cSize);
+            if (!ZSTD_isError(dSize) && rSize != ZSTD_CONTENTSIZE_UNKNOWN && dSize != rSize)
+            {
+                dSize = (size_t)-ZSTD_error_corruption_detected;
+            }
+        }
+        else
+        {
+            void* const rBuff = reserve_arena(arena, (size_t)rSize);
+            dSize = rBuff != NULL
+                ? ZSTD_decompressDCtx(dctx, rBuff, (size_t)rSize, cBuff, cSize)
+                : (size_t)-ZSTD_error_memory_allocation;
+        }
+        if (CHECK_ZSTD(dSize, "invalid decompress size of zstd in batch") != 0)
+        {
+            stats_record(&threadStats.decompress, start, srcs[i].n, -1);
+            failed++;
+
+            continue;
+        }
+
+        stats_record(&threadStats.decompress, start, srcs[i].n, (GoInt)dSize);
+        arena->size += (GoInt)dSize;
+    }
+    offsets[n] = arena->size;
+
+    release_dctx(dctx);
+    release_dict(entry);
+
+    return failed;
+}
+
+void ReleaseBatchArena(GoBatchArena* arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+
+    free(arena->data);
+
+    arena->data = NULL;
+    arena->cap = 0;
+    arena->size = 0;
+}
+
+GoInt CompressInto(GoString gs, void* dst, GoInt dstCap)
+{
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd compress into: data=%s, size=%zu, cap=%lld", gs.p, gs.n, dstCap);
+    }
+    size_t rSize = (size_t)gs.n;
+    void* const rBuff = (void* const)gs.p;
+
+    if (CHECK(dstCap >= 0 && (dst != NULL || dstCap == 0), "invalid dst buffer for compress") != 0)
+    {
+        return stats_into(&threadStats.compress, start, gs, dstCap, -1);
+    }
+
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
+    {
+        return stats_into(&threadStats.compress, start, gs, dstCap, -1);
+    }
+
+    size_t const cSize = ZSTD_compressCCtx(cctx, dst, (size_t)dstCap, rBuff, rSize, 3);
+    release_cctx(cctx);
+
+    /* Report the worst case size so the caller can grow its buffer and retry. */
+    if (ZSTD_isError(cSize) && ZSTD_getErrorCode(cSize) == ZSTD_error_dstSize_tooSmall)
+    {
+        return stats_into(&threadStats.compress, start, gs, dstCap, (GoInt)ZSTD_compressBound(rSize));
+    }
+    if (CHECK_ZSTD(cSize, "invalid compress size of zstd") != 0)
+    {
+        return stats_into(&threadStats.compress, start, gs, dstCap, -1);
+    }
+
+    return stats_into(&threadStats.compress, start, gs, dstCap, (GoInt)cSize);
+}
+
+GoInt DecompressInto(GoString gs, void* dst, GoInt dstCap)
+{
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress into: data=%s, size=%zu, cap=%lld", gs.p, gs.n, dstCap);
+    }
+    size_t cSize = (size_t)gs.n;
+    void* const cBuff = (void* const)gs.p;
+
+    if (CHECK(dstCap >= 0 && (dst != NULL || dstCap == 0), "invalid dst buffer for decompress") != 0)
+    {
+        return stats_into(&threadStats.decompress, start, gs, dstCap, -1);
+    }
+
+    unsigned long long const rSize = ZSTD_getFrameContentSize(cBuff, cSize);
+    if (CHECK(rSize != ZSTD_CONTENTSIZE_ERROR, "invalid compressed data of zstd") != 0)
+    {
+        return stats_into(&threadStats.decompress, start, gs, dstCap, -1);
+    }
+    if (rSize != ZSTD_CONTENTSIZE_UNKNOWN && rSize > (unsigned long long)dstCap)
+    {
+        return stats_into(&threadStats.decompress, start, gs, dstCap, (GoInt)rSize);
+    }
+
+    /* One-shot decompression also handles frames without a content size, as
+     * long as dst is large enough to hold the whole result.
+     */
+    ZSTD_DCtx* const dctx = acquire_dctx();
+    if (dctx == NULL)
+    {
+        return stats_into(&threadStats.decompress, start, gs, dstCap, -1);
+    }
+
+    size_t const dSize = ZSTD_decompressDCtx(dctx, dst, (size_t)dstCap, cBuff, cSize);
+    release_dctx(dctx);
+
+    if (ZSTD_isError(dSize) && ZSTD_getErrorCode(dSize) == ZSTD_error_dstSize_tooSmall)
+    {
+        unsigned long long const bound = ZSTD_decompressBound(cBuff, cSize);
+        if (CHECK(bound != ZSTD_CONTENTSIZE_ERROR, "invalid compressed data of zstd") != 0)
+        {
+            return stats_into(&threadStats.decompress, start, gs, dstCap, -1);
+        }
+
+        return stats_into(&threadStats.decompress, start, gs, dstCap, (GoInt)bound);
+    }
+    if (CHECK_ZSTD(dSize, "invalid decompress size of zstd") != 0)
+    {
+        return stats_into(&threadStats.decompress, start, gs, dstCap, -1);
+    }
+
+    return stats_into(&threadStats.decompress, start, gs, dstCap, (GoInt)dSize);
+}
+
+void SetSmallMode(GoInt passThrough, GoInt magicless)
+{
+    __atomic_store_n(&smallPassThrough, passThrough > 0 ? passThrough : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&smallMagicless, magicless != 0, __ATOMIC_RELAXED);
+
+    LOGF("[INFO] set small mode: passThrough=%lld, magicless=%lld ...", passThrough, magicless);
+}
+
+struct GoCompressResult CompressSmall(GoString gs, GoString dict)
+{
+    GoCompressResult result = {NULL, -1};
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd compress small: key=%s, data=%s, size=%zu", dict.p, gs.p, gs.n);
+    }
+    if (CHECK(gs.n >= 0, "invalid data for small compress") != 0)
+    {
+        return stats_compress(start, gs, result);
+    }
+
+    if (gs.n < __atomic_load_n(&smallPassThrough, __ATOMIC_RELAXED))
+    {
+        threadStats.skipped++;
+        result.size = 0;
+
+        return stats_compress(start, gs, result);
+    }
+
+    GoDict* entry = NULL;
+    if (dict.n > 0)
+    {
+        entry = load_dict(dict);
+        if (CHECK(entry != NULL, "cannot load cdict: key=%s", dict.p) != 0)
+        {
+            return stats_compress(start, gs, result);
+        }
+    }
+
+    size_t rSize = (size_t)gs.n;
+    void* const rBuff = (void* const)gs.p;
+
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
+    {
+        release_dict(entry);
+
+        return stats_compress(start, gs, result);
+    }
+
+    if (small_params(cctx, entry, rSize) != 0)
+    {
+        release_cctx(cctx);
+        release_dict(entry);
+
+        return stats_compress(start, gs, result);
+    }
+
+    /* Compress on the stack, the result is then allocated at its exact size */
+    char stackBuff[SMALL_STACK_SIZE];
+    size_t const cBuffSize = ZSTD_compressBound(rSize);
+    void* const cBuff = cBuffSize <= sizeof(stackBuff) ? stackBuff : malloc_orDie(cBuffSize);
+
+    size_t const cSize = ZSTD_compress2(cctx, cBuff, cBuffSize, rBuff, rSize);
+    release_cctx(cctx);
+
+    if (CHECK_ZSTD(cSize, "invalid compress size of zstd small") != 0)
+    {
+        if (cBuff != stackBuff)
+        {
+            free(cBuff);
+        }
+        release_dict(entry);
+
+        return stats_compress(start, gs, result);
+    }
+
+    if (entry != NULL)
+    {
+        record_dict_stats(entry, NULL, rBuff, rSize, cSize);
+        release_dict(entry);
+    }
+
+    if (cBuff == stackBuff)
+    {
+        result.data = malloc_orDie(cSize);
+        memcpy(result.data, stackBuff, cSize);
+    }
+    else
+    {
+        result.data = cBuff;
+    }
+    result.size = cSize;
+
+    return stats_compress(start, gs, result);
+}
+
+struct GoDecompressResult DecompressSmall(GoString gs, GoString dict)
+{
+    GoDecompressResult result = { NULL, -1 };
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress small: key=%s, data=%s, size=%zu", dict.p, gs.p, gs.n);
+    }
+    if (CHECK(gs.n >= 0, "invalid data for small decompress") != 0)
+    {
+        return stats_decompress(start, gs, result);
+    }
+
+    GoDict* entry = NULL;
+    if (dict.n > 0)
+    {
+        entry = load_dict(dict);
+        if (CHECK(entry != NULL, "cannot load ddict: key=%s", dict.p) != 0)
+        {
+            return stats_decompress(start, gs, result);
+        }
+    }
+
+    ZSTD_DCtx* const dctx = acquire_dctx();
+    if (dctx == NULL)
+    {
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
+    }
+
+    ZSTD_format_e const format = __atomic_load_n(&smallMagicless, __ATOMIC_RELAXED) ? ZSTD_f_zstd1_magicless : ZSTD_f_zstd1;
+    if (CHECK_ZSTD(ZSTD_DCtx_setParameter(dctx, ZSTD_d_format, format)) != 0 ||
+        (entry != NULL && CHECK_ZSTD(ZSTD_DCtx_refDDict(dctx, entry->ddict), "cannot init dict for decompress") != 0))
+    {
+        release_dctx(dctx);
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
+    }
+
+    /* The content size is not in the frame. Decompress on the stack and move
+     * to a heap buffer, doubled as needed, once the output outgrows it.
+     */
+    char stackBuff[SMALL_STACK_SIZE];
+    void* heapBuff = NULL;
+    ZSTD_inBuffer input = { gs.p, (size_t)gs.n, 0 };
+    ZSTD_outBuffer output = { stackBuff, sizeof(stackBuff), 0 };
+    for (;;)
+    {
+        size_t const ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (CHECK_ZSTD(ret, "invalid decompress of zstd small") != 0)
+        {
+            break;
+        }
+        if (ret == 0)
+        {
+            result.size = (GoInt)output.pos;
+
+            break;
+        }
+        if (output.pos < output.size)
+        {
+            if (CHECK(input.pos < input.size, "truncated data of zstd small") != 0)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        size_t const cap = output.size * 2;
+        if (heapBuff == NULL)
+        {
+            heapBuff = malloc_orDie(cap);
+            memcpy(heapBuff, stackBuff, output.pos);
+        }
+        else
+        {
+            heapBuff = realloc_orDie(heapBuff, cap);
+        }
+        output.dst = heapBuff;
+        output.size = cap;
+    }
+    release_dctx(dctx);
+    release_dict(entry);
+
+    if (result.size < 0)
+    {
+        free(heapBuff);
+
+        return stats_decompress(start, gs, result);
+    }
+
+    if (heapBuff == NULL)
+    {
+        heapBuff = malloc_orDie(output.pos > 0 ? output.pos : 1);
+        memcpy(heapBuff, stackBuff, output.pos);
+    }
+    result.data = heapBuff;
+
+    return stats_decompress(start, gs, result);
+}
+
+struct GoCompressResult Base64Encode(GoString gs, GoInt flags)
+{
+    GoCompressResult result = {NULL, -1};
+
+    if (CHECK(gs.n >= 0, "invalid data for base64 encode") != 0)
+    {
+        return result;
+    }
+
+    unsigned char* const out = malloc_orDie(base64_encode_bound((size_t)gs.n, (int)flags));
+
+    result.data = out;
+    result.size = (GoInt)base64_encode_into((const unsigned char*)gs.p, (size_t)gs.n, out, (int)flags);
+
+    return result;
+}
+
+struct GoDecompressResult Base64Decode(GoString gs)
+{
+    GoDecompressResult result = { NULL, -1 };
+
+    if (CHECK(gs.n >= 0, "invalid data for base64 decode") != 0)
+    {
+        return result;
+    }
+
+    unsigned char* const out = malloc_orDie(base64_decode_bound((size_t)gs.n));
+
+    size_t dSize;
+    if (CHECK(base64_decode_into((const unsigned char*)gs.p, (size_t)gs.n, out, &dSize, BASE64_URL_SAFE) == 0,
+              "invalid base64 data") != 0)
+    {
+        free(out);
+
+        return result;
+    }
+
+    result.data = out;
+    result.size = (GoInt)dSize;
+
+    return result;
+}
+
+GoInt Base64EncodeInto(GoString gs, void* dst, GoInt dstCap, GoInt flags)
+{
+    if (CHECK(gs.n >= 0 && dstCap >= 0 && (dst != NULL || dstCap == 0), "invalid dst buffer for base64 encode") != 0)
+    {
+        return -1;
+    }
+
+    size_t const bound = base64_encode_bound((size_t)gs.n, (int)flags);
+    if (bound > (size_t)dstCap)
+    {
+        return (GoInt)bound;
+    }
+
+    return (GoInt)base64_encode_into((const unsigned char*)gs.p, (size_t)gs.n, dst, (int)flags);
+}
+
+GoInt Base64DecodeInto(GoString gs, void* dst, GoInt dstCap)
+{
+    if (CHECK(gs.n >= 0 && dstCap >= 0 && (dst != NULL || dstCap == 0), "invalid dst buffer for base64 decode") != 0)
+    {
+        return -1;
+    }
+
+    size_t const bound = base64_decode_bound((size_t)gs.n);
+    if (bound > (size_t)dstCap)
+    {
+        return (GoInt)bound;
+    }
+
+    size_t dSize;
+    if (CHECK(base64_decode_into((const unsigned char*)gs.p, (size_t)gs.n, dst, &dSize, BASE64_URL_SAFE) == 0,
+              "invalid base64 data") != 0)
+    {
+        return -1;
+    }
+
+    return (GoInt)dSize;
+}
+
+struct GoCompressResult CompressToBase64(GoString gs, GoString dict, GoInt flags)
+{
+    GoCompressResult result = {NULL, -1};
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd compress to base64: key=%s, flags=%lld, data=%s, size=%zu", dict.p, flags, gs.p, gs.n);
+    }
+    GoDict* entry = NULL;
+    if (dict.n > 0)
+    {
+        entry = load_dict(dict);
+        if (CHECK(entry != NULL, "cannot load cdict: key=%s", dict.p) != 0)
+        {
+            return stats_compress(start, gs, result);
+        }
+    }
+
+    size_t rSize = (size_t)gs.n;
+    void* const rBuff = (void* const)gs.p;
+
+    /* The frame is compressed into the tail of the output, far enough from
+     * the head for base64 to encode it forwards in place.
+     */
+    size_t const cBuffSize = ZSTD_compressBound(rSize);
+    size_t const offset = base64_encode_bound(cBuffSize, (int)flags) - cBuffSize + base64InPlaceSlack;
+    unsigned char* const out = malloc_orDie(offset + cBuffSize);
+
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
+    {
+        free(out);
+        release_dict(entry);
+
+        return stats_compress(start, gs, result);
+    }
+
+    size_t const cSize = entry != NULL
+        ? ZSTD_compress_usingCDict(cctx, out + offset, cBuffSize, rBuff, rSize, entry->cdict)
+        : ZSTD_compressCCtx(cctx, out + offset, cBuffSize, rBuff, rSize, 3);
+    release_cctx(cctx);
+
+    if (CHECK_ZSTD(cSize, "invalid compress size of zstd to base64") != 0)
     {
-        /* error */
-        LOGF("[AddDict] %s : dict size is exceeded, limited to %d", name.p, dictLen);
-        exit(ERROR_maxDicts);
-    }
+        free(out);
+        release_dict(entry);
 
-    LOGF("[INFO] add dict(%s) with %s ...", name.p, filename.p);
+        return stats_compress(start, gs, result);
+    }
 
-    char* const dictFilename = (char* const)filename.p;
+    if (entry != NULL)
+    {
+        record_dict_stats(entry, NULL, rBuff, rSize, cSize);
+        release_dict(entry);
+    }
 
-    struct GoCDict cdict = {name, createCDict_orDie(dictFilename, 3)};
-    struct GoDDcit ddict = {name, createDDict_orDie(dictFilename)};
+    result.data = out;
+    result.size = (GoInt)base64_encode_into(out + offset, cSize, out, (int)flags);
 
-    globalCDicts.cdicts[globalCDicts.len++] = cdict;
-    globalDDicts.ddicts[globalDDicts.len++] = ddict;
+    return stats_compress(start, gs, result);
 }
 
-void ReleaseDict()
+struct GoDecompressResult DecompressFromBase64(GoString gs, GoString dict)
 {
-    int i;
-    for (i = 0; i < globalCDicts.len; i++)
+    GoDecompressResult result = { NULL, -1 };
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress from base64: key=%s, data=%s, size=%zu", dict.p, gs.p, gs.n);
+    }
+    if (gs.n <= 0)
     {
-        LOGF("[INFO] free cdict(%s) ...", globalCDicts.cdicts[i].key.p);
-        ZSTD_freeCDict(globalCDicts.cdicts[i].cdict);
+        return stats_decompress(start, gs, result);
     }
 
-    int j;
-    for (j = 0; j < globalDDicts.len; j++)
+    /* Decode into a per-thread scratch buffer, then decompress from it */
+    threadBase64Scratch.size = 0;
+    unsigned char* const cBuff = reserve_arena(&threadBase64Scratch, base64_decode_bound((size_t)gs.n));
+    if (cBuff == NULL)
     {
-        LOGF("[INFO] free ddict(%s) ...", globalDDicts.ddicts[i].key.p);
-        ZSTD_freeDDict(globalDDicts.ddicts[i].ddict);
+        return stats_decompress(start, gs, result);
     }
+
+    size_t cSize;
+    if (CHECK(base64_decode_into((const unsigned char*)gs.p, (size_t)gs.n, cBuff, &cSize, BASE64_URL_SAFE) == 0,
+              "invalid base64 data") != 0)
+    {
+        return stats_decompress(start, gs, result);
+    }
+
+    /* The frame is counted by the decompression it is handed to */
+    GoString const frame = { (const char*)cBuff, (ptrdiff_t)cSize };
+
+    return dict.n > 0 ? DecompressWithDict(frame, dict) : Decompress(frame);
 }
 
-struct GoCompressResult Compress(GoString gs)
+struct GoCompressResult CompressWithDict(GoString gs, GoString dict)
 {
     GoCompressResult result = {NULL, -1};
+    GoUint64 const start = stats_now();
 
     if (isDebug == 1)
     {
-        LOGF("[DEBUG] zstd compress: data=%s, size=%zu", gs.p, gs.n);
+        LOGF("[DEBUG] zstd compress with dict: key=%s, data=%s, size=%zu", dict.p, gs.p, gs.n);
+    }
+    GoDict* const entry = load_dict(dict);
+    ZSTD_CDict* cdict = entry != NULL ? entry->cdict : NULL;
+    if (CHECK(cdict != NULL, "cannot load cdict: key=%s", dict.p) != 0)
+    {
+        release_dict(entry);
+
+        return stats_compress(start, gs, result);
     }
+
     size_t rSize = (size_t)gs.n;
     void* const rBuff = (void* const)gs.p;
 
-    /* Compress */
-    size_t const cBuffSize = ZSTD_compressBound(rSize);
-    void* const cBuff = malloc(cBuffSize);
+    if (__atomic_load_n(&sampler.enabled, __ATOMIC_RELAXED))
+    {
+        sample_input(dict, gs);
+    }
 
-    size_t const cSize = ZSTD_compress(cBuff, cBuffSize, rBuff, rSize, 3);
-    if (CHECK_ZSTD(cSize, "invalid compress size of zstd") != 0)
+    if (probe_skip(gs))
     {
-        free(cBuff);
+        release_dict(entry);
+        result.size = 0;
 
-        return result;
+        return stats_compress(start, gs, result);
     }
 
-    result.data = cBuff;
-    result.size = cSize;
-
-    return result;
-}
+    GoUint64 hash = 0;
+    if (threadCompressCache.budget > 0 && cache_get(gs, entry->level, entry->generation, &hash, &result))
+    {
+        record_dict_stats(entry, NULL, rBuff, rSize, (size_t)result.size);
+        release_dict(entry);
 
-struct GoDecompressResult Decompress(GoString gs)
-{
-    GoDecompressResult result = { NULL, -1 };
+        return stats_compress(start, gs, result);
+    }
 
-    if (isDebug == 1)
+    /* Compress with dict */
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
     {
-        LOGF("[DEBUG] zstd decompress: data=%s, size=%zu", gs.p, gs.n);
+        release_dict(entry);
+
+        return stats_compress(start, gs, result);
     }
-    size_t cSize = (size_t)gs.n;
-    void* const cBuff = (void* const)gs.p;
 
-    /* Read the content size from the frame header. For simplicity we require
-     * that it is always present. By default, zstd will write the content size
-     * in the header when it is known. If you can't guarantee that the frame
-     * content size is always written into the header, either use streaming
-     * decompression, or ZSTD_decompressBound().
-     */
-    unsigned long long const rSize = ZSTD_getFrameContentSize(cBuff, cSize);
-    if (CHECK(rSize != ZSTD_CONTENTSIZE_ERROR, "invalid compressed data of zstd") != 0)
+    size_t const cBuffSize = ZSTD_compressBound(rSize);
+    void* const cBuff = malloc_orDie(cBuffSize);
+
+    size_t const cSize = ZSTD_compress_usingCDict(cctx, cBuff, cBuffSize, rBuff, rSize, cdict);
+    release_cctx(cctx);
+
+    if (CHECK_ZSTD(cSize, "invalid compress size of zstd with dict") != 0)
     {
-        return result;
+        free(cBuff);
+        release_dict(entry);
+
+        return stats_compress(start, gs, result);
     }
-    if (CHECK(rSize != ZSTD_CONTENTSIZE_UNKNOWN, "original size is unknown for zstd") != 0)
+
+    if (threadCompressCache.budget > 0)
     {
-        return StreamDecompress(gs);
+        cache_put(hash, rSize, entry->level, entry->generation, cBuff, cSize);
     }
+    record_dict_stats(entry, NULL, rBuff, rSize, cSize);
+    release_dict(entry);
 
+    result.data = cBuff;
+    result.size = cSize;
 
-    /* Decompress.
-     * If you are doing many decompressions, you may want to reuse the context
-     * and use ZSTD_decompressDCtx(). If you want to set advanced parameters,
-     * use ZSTD_DCtx_setParameter().
-     */
-    void* const rBuff = malloc_orDie((size_t)rSize);
+    return stats_compress(start, gs, result);
+}
 
-    size_t const dSize = ZSTD_decompress(rBuff, rSize, cBuff, cSize);
+void* CompressStreamBegin(GoInt level, GoString dict)
+{
     if (isDebug == 1)
     {
-        LOGF("[DEBUG] zstd decompress: data=%s, size=%zu, rsize=%llu, dsize=%zu", gs.p, gs.n, rSize, dSize);
+        LOGF("[DEBUG] zstd compress stream begin: level=%lld, key=%s", level, dict.p);
     }
-    if (CHECK_ZSTD(dSize, "invalid decompress size of zstd") != 0)
+    ZSTD_CCtx* const cctx = acquire_cctx();
+    if (cctx == NULL)
     {
-        free(rBuff);
-
-        return result;
+        return NULL;
     }
 
-    /* When zstd knows the content size, it will error if it doesn't match. */
-    if (CHECK(dSize == rSize, "Impossible because zstd will check this condition!") != 0)
+    size_t const lret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, (int)level);
+    if (CHECK_ZSTD(lret, "invalid compression level for stream compress") != 0)
     {
-        free(rBuff);
+        release_cctx(cctx);
 
-        return result;
+        return NULL;
     }
 
-    if (isDebug == 1)
+    /* Apply dict if supplied, keeping its reference for the stream lifetime */
+    GoDict* entry = NULL;
+    if (dict.n > 0)
     {
-        LOGF("[DEBUG] zstd decompress: result=%s, rsize=%llu, dsize=%zu", (char *)rBuff, rSize, dSize);
+        entry = load_dict(dict);
+        if (CHECK(entry != NULL, "cannot load cdict: key=%s", dict.p) != 0)
+        {
+            release_cctx(cctx);
+
+            return NULL;
+        }
+
+        size_t const dret = ZSTD_CCtx_refCDict(cctx, entry->cdict);
+        if (CHECK_ZSTD(dret, "cannot init dict for stream compress") != 0)
+        {
+            release_cctx(cctx);
+            release_dict(entry);
+
+            return NULL;
+        }
     }
-    result.data = rBuff;
-    result.size = rSize;
 
-    return result;
+    GoCompressStream* const stream = malloc_orDie(sizeof(GoCompressStream));
+    stream->cctx = cctx;
+    stream->dict = entry;
+    stream->buffSize = ZSTD_CStreamOutSize();
+    stream->buff = malloc_orDie(stream->buffSize);
+
+    return stream;
 }
 
-struct GoCompressResult CompressWithDict(GoString gs, GoString dict)
+struct GoCompressResult CompressStreamFeed(void* h, GoString chunk, GoInt flushMode)
 {
     GoCompressResult result = {NULL, -1};
+    GoUint64 const start = stats_now();
 
-    if (isDebug == 1)
+    GoCompressStream* const stream = (GoCompressStream*)h;
+    if (CHECK(stream != NULL, "invalid stream handle for compress") != 0)
     {
-        LOGF("[DEBUG] zstd compress with dict: key=%s, data=%s, size=%zu", dict.p, gs.p, gs.n);
+        return stats_compress(start, chunk, result);
     }
-    ZSTD_CDict* cdict = load_cdict(dict);
-    if (CHECK(cdict != NULL, "cannot load cdict: key=%s", dict.p) != 0)
+    if (CHECK(flushMode >= ZSTD_e_continue && flushMode <= ZSTD_e_end, "invalid flush mode: %lld", flushMode) != 0)
     {
-        return result;
+        return stats_compress(start, chunk, result);
     }
+    ZSTD_EndDirective const mode = (ZSTD_EndDirective)flushMode;
 
-    size_t rSize = (size_t)gs.n;
-    void* const rBuff = (void* const)gs.p;
-
-    /* Compress with dict */
-    ZSTD_CCtx* const cctx = ZSTD_createCCtx();
-    if (CHECK(cctx != NULL, "ZSTD_createCCtx() failed!") != 0)
+    if (isDebug == 1)
     {
-        return result;
+        LOGF("[DEBUG] zstd compress stream feed: data=%s, size=%zu, mode=%d", chunk.p, chunk.n, mode);
     }
+    ZSTD_inBuffer input = { chunk.p, (size_t)chunk.n, 0 };
+    ZSTD_outBuffer output = { stream->buff, stream->buffSize, 0 };
 
-    size_t const cBuffSize = ZSTD_compressBound(rSize);
-    void* const cBuff = malloc_orDie(cBuffSize);
+    /* With ZSTD_e_continue we are done once the chunk is consumed, while
+     * ZSTD_e_flush and ZSTD_e_end also need the remaining bytes to be drained.
+     */
+    for (;;) {
+        if (output.pos == output.size)
+        {
+            stream->buffSize *= 2;
+            stream->buff = realloc_orDie(stream->buff, stream->buffSize);
 
-    size_t const cSize = ZSTD_compress_usingCDict(cctx, cBuff, cBuffSize, rBuff, rSize, cdict);
-    ZSTD_freeCCtx(cctx);
+            output.dst = stream->buff;
+            output.size = stream->buffSize;
+        }
 
-    if (CHECK_ZSTD(cSize, "invalid compress size of zstd with dict") != 0)
-    {
-        free(cBuff);
+        size_t const remaining = ZSTD_compressStream2(stream->cctx, &output, &input, mode);
+        if (CHECK_ZSTD(remaining, "invalid stream compress of zstd") != 0)
+        {
+            return stats_compress(start, chunk, result);
+        }
 
-        return result;
+        if (mode == ZSTD_e_continue ? input.pos == input.size : remaining == 0)
+        {
+            break;
+        }
     }
 
-    result.data = cBuff;
-    result.size = cSize;
+    result.data = stream->buff;
+    result.size = output.pos;
 
-    return result;
+    return stats_compress(start, chunk, result);
+}
+
+void CompressStreamEnd(void* h)
+{
+    GoCompressStream* const stream = (GoCompressStream*)h;
+    if (stream == NULL)
+    {
+        return;
+    }
+
+    release_cctx(stream->cctx);
+    release_dict(stream->dict);
+    free(stream->buff);
+    free(stream);
 }
 
 struct GoDecompressResult DecompressWithDict(GoString gs, GoString dict)
 {
     GoDecompressResult result = { NULL, -1 };
+    GoUint64 const start = stats_now();
 
     if (isDebug == 1)
     {
         LOGF("[DEBUG] zstd decompress with dict: key=%s, data=%s, size=%zu", dict.p, gs.p, gs.n);
     }
-    ZSTD_DDict* ddict = load_ddict(dict);
-    if (CHECK(ddict != NULL, "cannot load ddict: key=%s", dict.p) != 0)
+    GoDict* const entry = load_dict(dict);
+    if (CHECK(entry != NULL, "cannot load ddict: key=%s", dict.p) != 0)
     {
-        return result;
+        return stats_decompress(start, gs, result);
     }
+    ZSTD_DDict* const ddict = entry->ddict;
 
     size_t cSize = (size_t)gs.n;
     void* const cBuff = (void* const)gs.p;
@@ -224,11 +1966,17 @@ struct GoDecompressResult DecompressWithDict(GoString gs, GoString dict)
     unsigned long long const rSize = ZSTD_getFrameContentSize(cBuff, cSize);
     if (CHECK(rSize != ZSTD_CONTENTSIZE_ERROR, "invalid compressed data of zstd") != 0)
     {
-        return result;
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
     }
     if (CHECK(rSize != ZSTD_CONTENTSIZE_UNKNOWN, "original size is unknown for zstd") != 0)
     {
-        return StreamDecompressWithDict(gs, dict);
+        threadStats.streamFallbacks++;
+        result = stream_decompress(gs, ddict);
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
     }
 
     /* Check that the dictionary ID matches.
@@ -240,24 +1988,25 @@ struct GoDecompressResult DecompressWithDict(GoString gs, GoString dict)
     unsigned const actualDictID = ZSTD_getDictID_fromFrame(cBuff, cSize);
     if (CHECK(actualDictID == expectedDictID, "ID of dict mismatch: expected %u got %u", expectedDictID, actualDictID) != 0)
     {
-        return result;
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
     }
 
-    /* Decompress.
-     * If you are doing many decompressions, you may want to reuse the context
-     * and use ZSTD_decompressDCtx(). If you want to set advanced parameters,
-     * use ZSTD_DCtx_setParameter().
-     */
-    ZSTD_DCtx* const dctx = ZSTD_createDCtx();
-    if (CHECK(dctx != NULL, "ZSTD_createDCtx() failed!") != 0)
+    /* Decompress with a pooled context, reused across calls. */
+    ZSTD_DCtx* const dctx = acquire_dctx();
+    if (dctx == NULL)
     {
-        return result;
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
     }
 
     void* const rBuff = malloc_orDie((size_t)rSize);
 
     size_t const dSize = ZSTD_decompress_usingDDict(dctx, rBuff, rSize, cBuff, cSize, ddict);
-    ZSTD_freeDCtx(dctx);
+    release_dctx(dctx);
+    release_dict(entry);
 
     if (isDebug == 1)
     {
@@ -267,7 +2016,7 @@ struct GoDecompressResult DecompressWithDict(GoString gs, GoString dict)
     {
         free(rBuff);
 
-        return result;
+        return stats_decompress(start, gs, result);
     }
 
     /* When zstd knows the content size, it will error if it doesn't match. */
@@ -275,7 +2024,7 @@ struct GoDecompressResult DecompressWithDict(GoString gs, GoString dict)
     {
         free(rBuff);
 
-        return result;
+        return stats_decompress(start, gs, result);
     }
 
     if (isDebug == 1)
@@ -285,113 +2034,231 @@ struct GoDecompressResult DecompressWithDict(GoString gs, GoString dict)
     result.data = rBuff;
     result.size = rSize;
 
-    return result;
-}
-
-struct GoDecompressResult StreamDecompress(GoString gs)
-{
-    GoString dict = { NULL, -1 };
-
-    return StreamDecompressWithDict(gs, dict);
+    return stats_decompress(start, gs, result);
 }
 
-struct GoDecompressResult StreamDecompressWithDict(GoString gs, GoString dict)
+void* DecompressStreamBegin(GoString dict, GoInt maxOutput)
 {
-    GoDecompressResult result = { NULL, -1 };
-
     if (isDebug == 1)
     {
-        LOGF("[DEBUG] zstd stream decompress with dict: key=%s, data=%s, size=%zu", dict.p, gs.p, gs.n);
+        LOGF("[DEBUG] zstd decompress stream begin: key=%s, maxOutput=%lld", dict.p, maxOutput);
     }
-    ZSTD_DCtx* const dctx = ZSTD_createDCtx();
-    if (CHECK(dctx != NULL, "ZSTD_createDCtx() failed!") != 0)
+    if (CHECK(maxOutput >= 0, "invalid max output for stream decompress") != 0)
     {
-        return result;
+        return NULL;
+    }
+    ZSTD_DCtx* const dctx = acquire_dctx();
+    if (dctx == NULL)
+    {
+        return NULL;
     }
 
-    /* Apply dict if supplied */
+    /* Apply dict if supplied, keeping its reference for the stream lifetime */
+    GoDict* entry = NULL;
     if (dict.n > 0)
     {
-        ZSTD_DDict* ddict = load_ddict(dict);
-        if (CHECK(ddict != NULL, "cannot load ddict: key=%s", dict.p) != 0)
+        entry = load_dict(dict);
+        if (CHECK(entry != NULL, "cannot load ddict: key=%s", dict.p) != 0)
         {
-            ZSTD_freeDCtx(dctx);
+            release_dctx(dctx);
 
-            return result;
+            return NULL;
         }
 
-        size_t const dret = ZSTD_DCtx_refDDict(dctx, ddict);
+        size_t const dret = ZSTD_DCtx_refDDict(dctx, entry->ddict);
         if (CHECK_ZSTD(dret, "cannot init dict for stream decompress") != 0)
         {
-            ZSTD_freeDCtx(dctx);
+            release_dctx(dctx);
+            release_dict(entry);
 
-            return result;
+            return NULL;
         }
     }
 
-    size_t cSize = (size_t)gs.n;
-    void* const cBuff = (void* const)gs.p;
+    GoDecompressStream* const stream = malloc_orDie(sizeof(GoDecompressStream));
+    stream->dctx = dctx;
+    stream->dict = entry;
+    stream->maxOutput = maxOutput > 0 ? (size_t)maxOutput : streamHintMax;
+    stream->buffSize = ZSTD_DStreamOutSize() < stream->maxOutput ? ZSTD_DStreamOutSize() : stream->maxOutput;
+    stream->buff = malloc_orDie(stream->buffSize);
 
-    size_t const buffOutSize = ZSTD_DStreamOutSize();
-    void* const buffOut = malloc_orDie(buffOutSize);
-
-    /* Given a valid frame, zstd won't consume the last byte of the frame
-    * until it has flushed all of the decompressed data of the frame.
-    * Therefore, instead of checking if the return code is 0, we can
-    * decompress just check if input.pos < input.size.
-    */
-    ZSTD_inBuffer input = { cBuff, cSize, 0 };
-
-    while (input.pos < input.size) {
-        ZSTD_outBuffer output = { buffOut, buffOutSize, 0 };
-        /* The return code is zero if the frame is complete, but there may
-        * be multiple frames concatenated together. Zstd will automatically
-        * reset the context when a frame is complete. Still, calling
-        * ZSTD_DCtx_reset() can be useful to reset the context to a clean
-        * state, for instance if the last decompression call returned an
-        * error.
-        */
-        size_t const ret = ZSTD_decompressStream(dctx, &output , &input);
-        if (CHECK_ZSTD(ret, "invalid frame of zstd") != 0)
-        {
-            result.data = NULL;
-            result.size = -1;
+    return stream;
+}
 
-            break;
-        }
+struct GoDecompressResult DecompressStreamFeed(void* h, GoString chunk)
+{
+    GoDecompressResult result = { NULL, -1 };
+    GoUint64 const start = stats_now();
+
+    GoDecompressStream* const stream = (GoDecompressStream*)h;
+    if (CHECK(stream != NULL, "invalid stream handle for decompress") != 0)
+    {
+        return stats_decompress(start, chunk, result);
+    }
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress stream feed: data=%s, size=%zu", chunk.p, chunk.n);
+    }
+    ZSTD_inBuffer input = { chunk.p, (size_t)chunk.n, 0 };
+    ZSTD_outBuffer output = { stream->buff, stream->buffSize, 0 };
 
-        if (result.size == -1 )
+    /* A full output buffer may mean zstd still holds decoded bytes, so keep
+     * going until the chunk is consumed and the last call left room to spare,
+     * but never grow the buffer past maxOutput.
+     */
+    while (input.pos < input.size || output.pos == output.size) {
+        if (output.pos == output.size)
         {
-            if (isDebug == 1)
+            if (CHECK(stream->buffSize < stream->maxOutput, "stream decompress output exceeds %zu bytes",
+                      stream->maxOutput) != 0)
             {
-                LOGF("[DEBUG] zstd stream dict decompress: alloc data=%s, size=%zu", (char *)buffOut, output.pos);
+                return stats_decompress(start, chunk, result);
             }
-            result.data = malloc_orDie(output.pos);
-            result.size = output.pos;
 
-            memcpy(result.data, buffOut, output.pos);
+            stream->buffSize = stream->buffSize < stream->maxOutput / 2 ? stream->buffSize * 2 : stream->maxOutput;
+            stream->buff = realloc_orDie(stream->buff, stream->buffSize);
+
+            output.dst = stream->buff;
+            output.size = stream->buffSize;
         }
-        else
+
+        size_t const ret = ZSTD_decompressStream(stream->dctx, &output, &input);
+        if (CHECK_ZSTD(ret, "invalid frame of zstd") != 0)
         {
-            if (isDebug == 1)
-            {
-                LOGF("[DEBUG] zstd stream dict decompress: realloc data=%s, size=%zu", (char *)buffOut, output.pos);
-            }
-            size_t const size = result.size+output.pos;
-            void* const data = malloc_orDie(size);
+            return stats_decompress(start, chunk, result);
+        }
+    }
+
+    result.data = stream->buff;
+    result.size = output.pos;
+
+    return stats_decompress(start, chunk, result);
+}
+
+void DecompressStreamEnd(void* h)
+{
+    GoDecompressStream* const stream = (GoDecompressStream*)h;
+    if (stream == NULL)
+    {
+        return;
+    }
 
-            memcpy(data, result.data, result.size);
-            memcpy(data+result.size, buffOut, output.pos);
+    release_dctx(stream->dctx);
+    release_dict(stream->dict);
+    free(stream->buff);
+    free(stream);
+}
+
+struct GoDecompressResult DecompressAuto(GoString gs)
+{
+    GoDecompressResult result = { NULL, -1 };
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd decompress auto: data=%s, size=%zu", gs.p, gs.n);
+    }
+    size_t cSize = (size_t)gs.n;
+    void* const cBuff = (void* const)gs.p;
+
+    /* Pick the dictionary from the dictID written in the frame header. Frames
+     * without a dictID are decompressed without a dictionary.
+     */
+    unsigned const dictID = ZSTD_getDictID_fromFrame(cBuff, cSize);
+    GoDict* const entry = load_dict_by_id(dictID);
+    if (CHECK(dictID == 0 || entry != NULL, "cannot load ddict: id=%u", dictID) != 0)
+    {
+        return stats_decompress(start, gs, result);
+    }
+
+    unsigned long long const rSize = ZSTD_getFrameContentSize(cBuff, cSize);
+    if (CHECK(rSize != ZSTD_CONTENTSIZE_ERROR, "invalid compressed data of zstd") != 0)
+    {
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
+    }
+    if (rSize == ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        /* Hand over the DDict itself: the entry may no longer be registered
+         * under its name, but is kept alive by the reference held here.
+         */
+        result = stream_decompress(gs, entry != NULL ? entry->ddict : NULL);
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
+    }
+
+    ZSTD_DCtx* const dctx = acquire_dctx();
+    if (dctx == NULL)
+    {
+        release_dict(entry);
+
+        return stats_decompress(start, gs, result);
+    }
 
-            free(result.data);
+    if (entry != NULL)
+    {
+        size_t const dret = ZSTD_DCtx_refDDict(dctx, entry->ddict);
+        if (CHECK_ZSTD(dret, "cannot init dict for decompress") != 0)
+        {
+            release_dctx(dctx);
+            release_dict(entry);
 
-            result.data = data;
-            result.size = size;
+            return stats_decompress(start, gs, result);
         }
     }
 
-    ZSTD_freeDCtx(dctx);
-    free(buffOut);
+    void* const rBuff = malloc_orDie((size_t)rSize);
+
+    size_t const dSize = ZSTD_decompressDCtx(dctx, rBuff, rSize, cBuff, cSize);
+    release_dctx(dctx);
+    release_dict(entry);
 
-    return result;
+    if (CHECK_ZSTD(dSize, "invalid decompress size of zstd") != 0)
+    {
+        free(rBuff);
+
+        return stats_decompress(start, gs, result);
+    }
+
+    result.data = rBuff;
+    result.size = dSize;
+
+    return stats_decompress(start, gs, result);
+}
+
+struct GoDecompressResult StreamDecompress(GoString gs)
+{
+    GoString dict = { NULL, -1 };
+
+    return StreamDecompressWithDict(gs, dict);
+}
+
+struct GoDecompressResult StreamDecompressWithDict(GoString gs, GoString dict)
+{
+    GoDecompressResult result = { NULL, -1 };
+    GoUint64 const start = stats_now();
+
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] zstd stream decompress with dict: key=%s, data=%s, size=%zu", dict.p, gs.p, gs.n);
+    }
+    if (dict.n <= 0)
+    {
+        return stats_decompress(start, gs, stream_decompress(gs, NULL));
+    }
+
+    /* The reference keeps the DDict alive for the whole decompression */
+    GoDict* const entry = load_dict(dict);
+    if (CHECK(entry != NULL, "cannot load ddict: key=%s", dict.p) != 0)
+    {
+        return stats_decompress(start, gs, result);
+    }
+
+    result = stream_decompress(gs, entry->ddict);
+    release_dict(entry);
+
+    return stats_decompress(start, gs, result);
 }
\ No newline at end of file
@@ -9,7 +9,23 @@
 #include <string.h>    // strerror
 #include <errno.h>     // errno
 #include <sys/stat.h>  // stat
+#include <sys/mman.h>  // mmap, munmap
+#include <fcntl.h>     // open
+#include <unistd.h>    // close
+#include <limits.h>    // PATH_MAX
+#include <time.h>      // time
+#include <pthread.h>   // pthread_mutex_t
+#define ZSTD_STATIC_LINKING_ONLY /* ZSTD_decompressBound, advanced parameters */
 #include <zstd.h>
+#include <zstd_errors.h>
+#include <zstd_seekable.h>
+#define ZDICT_STATIC_LINKING_ONLY /* cover and fastCover trainers */
+#include <zdict.h>
+#ifndef XXH_NAMESPACE
+#define XXH_NAMESPACE ZSTD_ /* as built into libzstd */
+#endif
+#include <xxhash.h>
+#include <hist.h>
 #include "base64.h"
 
 #ifndef KONG_ZSTD_H
@@ -60,11 +76,153 @@ typedef struct { void *data; GoInt len; GoInt cap; } GoSlice;
 typedef struct GoCompressResult { void *data; GoInt size; } GoCompressResult;
 typedef struct GoDecompressResult { void *data; GoInt size; } GoDecompressResult;
 
-typedef struct GoCDict { GoString key; ZSTD_CDict* cdict; } GoCDict;
-typedef struct GoDDcit { GoString key; ZSTD_DDict* ddict; } GoDDict;
+/* Effectiveness counters of a dictionary, updated with atomics; ratios in thousandths */
+typedef struct GoDictCounters {
+    GoUint64 calls; GoUint64 bytesIn; GoUint64 bytesOut;
+    GoUint64 windowIn; GoUint64 windowOut; GoUint64 rolling; GoUint64 baseline;
+    GoUint64 probeIn; GoUint64 probeOut;
+} GoDictCounters;
+
+/* A registered dictionary. The registry holds one reference, calls and
+ * streams using the dictionary hold one each, and the entry is freed with the
+ * last one.
+ */
+typedef struct GoDict { char* key; size_t keyLen; GoUint64 hash; unsigned dictID; int level; int refs; int shared; ZSTD_CDict* cdict; ZSTD_DDict* ddict; GoDictCounters counters; GoUint64 generation; struct GoDict* retired; } GoDict;
+
+/* Return type for GetDictStats. rollingRatio covers the last window of
+ * dictStatsWindow input bytes and baselineRatio the first one, noDictRatio
+ * is measured by compressing one call in dictProbeEvery without the dict.
+ */
+typedef struct GoDictStats {
+    GoUint64 calls; GoUint64 bytesIn; GoUint64 bytesOut;
+    GoFloat64 ratio; GoFloat64 rollingRatio; GoFloat64 baselineRatio; GoFloat64 noDictRatio;
+    GoInt drifted;
+} GoDictStats;
+
+/* Bump allocator over MAP_SHARED anonymous chunks. It holds the content and
+ * digested tables of dictionaries added by AddSharedDict, so that workers
+ * forked afterwards map the very same pages instead of each owning a copy.
+ * The bump state is private to each process, so only the process that mapped
+ * the chunks (pid) may allocate from them.
+ */
+typedef struct SharedDictChunk { char* base; size_t size; } SharedDictChunk;
+typedef struct SharedDictArena { SharedDictChunk chunks[64]; int len; size_t used; int frozen; pid_t pid; } SharedDictArena;
+
+/* Open-addressing (linear probing) tables of dictionaries, indexed by name and
+ * by dictID. Both tables share the same power-of-two capacity.
+ *
+ * Lookups take no lock. A single writer (the thread adding, replacing or
+ * removing dictionaries) publishes slots and tables with atomic stores, and
+ * rebuilds the tables instead of moving slots under a probing reader. Readers
+ * count themselves in dictReaders while they probe and take a reference on
+ * the entry they find, so a call in flight finishes on the entry it found.
+ * What the writer unlinks is retired and only released once no reader is
+ * probing.
+ */
+typedef struct GoDictTable { size_t cap; GoDict** slots; GoDict** idSlots; struct GoDictTable* retired; } GoDictTable;
+typedef struct GlobalGoDict { GoDictTable* table; size_t len; GoDict* retiredDicts; GoDictTable* retiredTables; } GlobalGoDict;
+
+/* Compression parameters registered by AddParams. Fields follow the matching
+ * ZSTD_cParameter, so 0 selects the zstd default for every field. zstd writes
+ * the content size by default, hence noContentSize inverts
+ * ZSTD_c_contentSizeFlag. maxRatio, in per-mille of the input, makes
+ * compression give up once the output grows past that share of the input
+ * consumed so far; 0 never gives up.
+ */
+typedef struct GoCompressParams { GoInt level; GoInt windowLog; GoInt strategy; GoInt checksumFlag; GoInt noContentSize; GoInt nbWorkers; GoInt jobSize; GoInt maxRatio; } GoCompressParams;
+
+/* Open-addressing (linear probing) table of named params, doubled as it
+ * fills up. Entries never move, and outgrown tables are kept until
+ * ReleaseParams, so lookups take no lock while AddParams runs.
+ */
+typedef struct GoParams { char* key; size_t keyLen; GoUint64 hash; GoCompressParams params; } GoParams;
+typedef struct GoParamsTable { size_t cap; GoParams** slots; struct GoParamsTable* retired; } GoParamsTable;
+typedef struct GlobalGoParams { GoParamsTable* table; size_t len; } GlobalGoParams;
+
+/* Opaque handle for CompressStreamBegin/Feed/End */
+typedef struct GoCompressStream { ZSTD_CCtx* cctx; GoDict* dict; void* buff; size_t buffSize; } GoCompressStream;
+
+/* Opaque handle for DecompressStreamBegin/Feed/End */
+typedef struct GoDecompressStream { ZSTD_DCtx* dctx; GoDict* dict; void* buff; size_t buffSize; size_t maxOutput; } GoDecompressStream;
+
+/* Output arena of CompressBatch/DecompressBatch. It is grown as needed and
+ * meant to be reused across batches, then freed with ReleaseBatchArena.
+ */
+typedef struct GoBatchArena { void* data; GoInt cap; GoInt size; } GoBatchArena;
+
+/* Parameters of TrainDict. Zero fields select the zstd defaults: fastCover
+ * searching d=8 over 4 steps, like `zstd --train`. With optimize set, the
+ * slower cover algorithm searches k and d for the best dictionary.
+ */
+typedef struct GoTrainParams { GoInt level; GoInt k; GoInt d; GoInt steps; GoInt optimize; } GoTrainParams;
+
+/* Training job run by a background thread of TrainDict */
+typedef struct GoTrainJob {
+    GoString name; GoTrainParams params;
+    void* samples; size_t* sampleSizes; unsigned n;
+    void* dict; size_t dictSize;
+    struct GoTrainJob* next;
+} GoTrainJob;
+
+/* Reservoir of input samples kept for one key: the dict name passed to
+ * CompressWithDict, or the empty key for Compress.
+ */
+typedef struct GoSample { void* data; size_t size; } GoSample;
+typedef struct GoReservoir {
+    char* key; size_t keyLen; GoUint64 hash;
+    GoUint64 seen; GoSample* samples; int len;
+    struct GoReservoir* next;
+} GoReservoir;
+
+typedef struct GoSampler {
+    int enabled; int maxSamples; size_t maxSampleSize; size_t cap; size_t used;
+    GoUint64 rand; GoReservoir* reservoirs;
+} GoSampler;
+
+/* Per-thread LRU cache of compressed outputs, keyed by the XXH64 of the
+ * input together with the level and the generation of the registry entry it
+ * was compressed with (0 without dict). Raw content dicts all have dictID 0,
+ * so the dictID cannot tell them apart from each other or from no dict.
+ */
+typedef struct GoCacheEntry {
+    GoUint64 hash; size_t rSize; GoUint64 generation; int level;
+    void* data; size_t size;
+    struct GoCacheEntry* prev; struct GoCacheEntry* next; struct GoCacheEntry* chain;
+} GoCacheEntry;
+
+/* Return type for GetCompressCacheStats */
+typedef struct GoCompressCacheStats { GoUint64 hits; GoUint64 misses; GoUint64 evictions; GoInt entries; GoInt bytes; } GoCompressCacheStats;
+
+typedef struct ThreadCompressCache {
+    GoCacheEntry** buckets; size_t cap; size_t budget;
+    GoCacheEntry* head; GoCacheEntry* tail;
+    GoCompressCacheStats stats;
+} ThreadCompressCache;
+
+/* Counters of one operation. latency[size][time] counts calls by payload
+ * size bucket (<256B, <1KB, ... >=1MB, powers of 4) and latency bucket
+ * (<1us, <4us, ... >=4ms, powers of 4). Each block starts on its own cache
+ * line.
+ */
+typedef struct GoOpStats {
+    GoUint64 calls; GoUint64 errors; GoUint64 bytesIn; GoUint64 bytesOut; GoUint64 latencyNs;
+    GoUint64 latency[8][8];
+} __attribute__((aligned(64))) GoOpStats;
+
+/* Snapshot type for GetStats */
+typedef struct GoStats {
+    GoOpStats compress; GoOpStats decompress;
+    GoUint64 cctxAllocs; GoUint64 dctxAllocs; GoUint64 streamFallbacks; GoUint64 skipped;
+} __attribute__((aligned(64))) GoStats;
+
+/* Return type for GetCtxPoolStats */
+typedef struct GoCtxPoolStats { GoUint64 cctxHits; GoUint64 cctxMisses; GoUint64 dctxHits; GoUint64 dctxMisses; } GoCtxPoolStats;
 
-typedef struct GlobalGoCDict { GoCDict cdicts[10]; int len; } GlobalGoCDict;
-typedef struct GlobalGoDDict { GoDDict ddicts[10]; int len; } GlobalGoDDict;
+typedef struct ThreadCtxPool {
+    ZSTD_CCtx* cctxs[4]; int cctxLen;
+    ZSTD_DCtx* dctxs[4]; int dctxLen;
+    GoCtxPoolStats stats;
+} ThreadCtxPool;
 
 /* End of boilerplate cgo prologue.  */
 
@@ -72,25 +230,263 @@ typedef struct GlobalGoDDict { GoDDict ddicts[10]; int len; } GlobalGoDDict;
 extern "C" {
 #endif
 
-static int dictLen = 10;
 static int isDebug = -1;
 
-static GlobalGoCDict globalCDicts = {};
-static GlobalGoDDict globalDDicts = {};
+static size_t dictInitCap = 16;
+static size_t dictMmapMin = 1 << 20;
+
+static GoUint64 dictStatsWindow = 1 << 20;
+static GoUint64 dictProbeEvery = 64;
+static GoUint64 dictDriftTolerance = 900; /* drifted below 90% of the baseline */
+
+static int sharedDictChunksLen = 64;
+static size_t sharedDictChunkSize = 8 << 20;
+static SharedDictArena sharedDictArena = {};
+static GlobalGoDict globalDicts = {};
+static int dictReaders = 0;
+/* Source of GoDict.generation: every entry created, including the new entry
+ * of a ReplaceDict or trained swap, gets the next value, never 0.
+ */
+static GoUint64 dictGenerations = 0;
+
+static size_t paramsInitCap = 16;
+static GlobalGoParams globalParams = {};
+
+/* Process-wide multi-threaded compression context used by CompressMT. Its
+ * ZSTDMT worker threads are spawned once and reused by every request.
+ */
+static int mtDefaultWorkers = 4;
+static pthread_mutex_t mtCCtxLock = PTHREAD_MUTEX_INITIALIZER;
+static ZSTD_CCtx* mtCCtx = NULL;
+
+/* Dictionaries trained in the background are queued here and registered by
+ * the worker thread on its next dictionary lookup, so the registry keeps a
+ * single writer.
+ */
+static pthread_mutex_t trainLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trainCond = PTHREAD_COND_INITIALIZER;
+static int trainRunning = 0;
+static GoTrainJob* trainedDicts = NULL;
+
+/* Input sampler fed by Compress and CompressWithDict. When sampling is off
+ * the only cost is one load of sampler.enabled; otherwise samples are taken
+ * under samplerLock.
+ */
+static pthread_mutex_t samplerLock = PTHREAD_MUTEX_INITIALIZER;
+static GoSampler sampler = {};
+
+static size_t cacheInitCap = 1024;
+static __thread ThreadCompressCache threadCompressCache = {};
+
+static GoInt probeMinGain = 0; /* per-mille, 0 keeps the probe off */
+static int probeSlices = 8;
+static size_t probeSliceSize = 1 << 10;
+
+/* CompressSmall passes inputs shorter than smallPassThrough through, and
+ * compresses the others into a stack buffer when their bound fits it.
+ */
+#define SMALL_STACK_SIZE (1 << 10)
+static GoInt smallPassThrough = 0;
+static int smallMagicless = 0;
+
+/* Metrics of Compress, CompressWithDict, Decompress and DecompressWithDict,
+ * per thread like the context pool so updates are plain increments.
+ */
+static int statsBuckets = 8;
+static __thread GoStats threadStats = {};
+
+static int ctxPoolLen = 4;
+static size_t streamHintMax = 16 << 20;
+
+/* base64_encode_into runs in place when its output starts this many bytes
+ * ahead of the minimum distance to its input.
+ */
+static size_t base64InPlaceSlack = 32;
+static __thread GoBatchArena threadBase64Scratch = {};
+static __thread ThreadCtxPool threadCtxPool = {};
 
 extern void EnableDebug();
 extern void DisableDebug();
 
+/* Adding, replacing and removing dictionaries must happen on one thread at a
+ * time; calls using a dictionary may run concurrently on any thread and keep
+ * the entry they started with.
+ */
 extern void AddDict(GoString name, GoString filename);
+extern void AddDictWithLevel(GoString name, GoString filename, GoInt level);
+extern GoInt AddDictFromMemory(GoString name, void* dict, GoInt dictSize, GoInt isBase64);
+extern GoInt ReplaceDict(GoString name, GoString filename);
+
+/* AddSharedDict is meant for the init phase of the nginx master: dictionaries
+ * are digested once into shared memory and inherited by every worker. After
+ * FreezeSharedDicts the memory is read-only and no shared dict can be added.
+ * Workers forked before the freeze cannot add shared dicts either.
+ * RemoveDict unregisters a shared dict but never gives its arena memory back.
+ */
+extern GoInt AddSharedDict(GoString name, GoString filename, GoInt level);
+extern GoInt FreezeSharedDicts();
+extern GoInt RemoveDict(GoString name);
+extern GoInt GetDictStats(GoString name, GoDictStats* stats);
+
+/* TrainDict learns a dictionary from samples concatenated in one buffer on a
+ * background thread. Trained dictionaries are only registered, under name
+ * and replacing a dict of that name, by InstallTrainedDicts or
+ * WaitTrainDicts; both change the registry and so follow the same threading
+ * rule as ReplaceDict. InstallTrainedDicts registers the trainings finished
+ * so far without blocking, WaitTrainDicts waits for every training started
+ * so far first. Both return the number of dictionaries registered.
+ */
+extern GoInt TrainDict(GoString name, void* samples, size_t* sampleSizes, GoInt n, GoInt dictCapacity, GoTrainParams params);
+extern GoInt InstallTrainedDicts();
+extern GoInt WaitTrainDicts();
+
+/* Sampling keeps up to maxSamples inputs per key, truncated to maxSampleSize
+ * bytes and within memoryCap bytes overall, with uniform reservoir sampling.
+ * GetSamples copies the samples of a key into an arena laid out as TrainDict
+ * expects; WriteSamples stores them one file each in a directory, for
+ * `zstd --train -r dir`.
+ */
+extern void EnableSampling(GoInt maxSamples, GoInt maxSampleSize, GoInt memoryCap);
+extern void DisableSampling();
+extern GoInt GetSamples(GoString key, GoBatchArena* arena, size_t* sampleSizes, GoInt maxN);
+extern GoInt WriteSamples(GoString key, GoString dir);
 extern void ReleaseDict();
 
+/* Params are looked up by name without a lock, also while AddParams runs.
+ * ReleaseParams frees them all and must not overlap calls using params.
+ */
+extern GoInt AddParams(GoString name, GoCompressParams params);
+extern void ReleaseParams();
+
+/* The compressed output cache is off until EnableCompressCache is called with
+ * a byte budget. Compress and CompressWithDict then return the cached output
+ * for inputs they have already compressed with the same level and dict.
+ * Outputs are tied to the registered entry, not its name or dictID, so a
+ * replaced dict starts afresh.
+ */
+extern void EnableCompressCache(GoInt budget);
+extern void DisableCompressCache();
+extern struct GoCompressCacheStats GetCompressCacheStats();
+
+/* The compressibility probe is off until EnableCompressProbe is called with a
+ * minimum gain in per-mille of the input size. Compress and CompressWithDict
+ * then return {NULL, 0} for inputs estimated to gain less, and the caller
+ * sends them as is. ProbeCompressible returns the estimated gain (0-1000).
+ */
+extern void EnableCompressProbe(GoInt minGain);
+extern void DisableCompressProbe();
+extern GoInt ProbeCompressible(GoString src);
+
+/* GetStats returns the counters of the calling thread. Every compression and
+ * decompression entry point counts each call once: the one-shot, dict,
+ * params, MT, seekable, small, base64 and Into variants, each item of a
+ * batch, each feed of a stream, and DecompressAuto/StreamDecompress. An Into
+ * call returning a larger size to retry with is left to the retry, and a
+ * call handing over to another one (DecompressFromBase64) is counted by the
+ * latter. Base64Encode/Base64Decode do not compress and are not counted.
+ */
+extern void GetStats(GoStats* stats);
+
+extern struct GoCtxPoolStats GetCtxPoolStats();
+extern void ReleaseCtxPool();
+
 extern struct GoCompressResult Compress(GoString src);
 extern struct GoDecompressResult Decompress(GoString dst);
 extern struct GoDecompressResult StreamDecompress(GoString dst);
 
+/* CompressMT needs libzstd built with ZSTD_MULTITHREAD (make libzstd-mt.so),
+ * otherwise, or while another thread holds the shared context, it compresses
+ * single-threaded with a pooled context, as it does for params without
+ * workers. The shared context and its worker threads are created by the
+ * first CompressMT call with workers, which must come after fork (in the
+ * nginx workers, not the master): threads do not survive fork, and a child
+ * inheriting the context would wait on them forever.
+ */
+extern struct GoCompressResult CompressMT(GoString src, GoString params);
+
+/* CompressInto/DecompressInto write into a caller owned buffer and return the
+ * written size. A result larger than dstCap means nothing was written and the
+ * buffer must be grown to at least that size. -1 is returned on error,
+ * including a negative dstCap.
+ */
+extern GoInt CompressInto(GoString src, void* dst, GoInt dstCap);
+extern GoInt DecompressInto(GoString src, void* dst, GoInt dstCap);
+
+/* Base64Encode/Base64Decode expose base64.c, with the flags of
+ * CompressToBase64. Decoding accepts the standard and URL-safe alphabets. The
+ * Into variants follow the same buffer protocol as CompressInto.
+ */
+extern struct GoCompressResult Base64Encode(GoString src, GoInt flags);
+extern struct GoDecompressResult Base64Decode(GoString src);
+extern GoInt Base64EncodeInto(GoString src, void* dst, GoInt dstCap, GoInt flags);
+extern GoInt Base64DecodeInto(GoString src, void* dst, GoInt dstCap);
+
+/* CompressBatch/DecompressBatch process n items with one context and write
+ * the results back to back into the arena, item i spanning offsets[i] to
+ * offsets[i+1], so offsets must hold n+1 entries. A failed item is stored
+ * empty. They return the number of failed items, or -1 on error.
+ * DecompressBatch streams frames that carry no content size or declare one
+ * above streamHintMax, so the arena only grows with the output they actually
+ * produce, and an item that would overflow the arena fails instead.
+ */
+extern GoInt CompressBatch(GoString* srcs, GoInt n, GoString dict, GoBatchArena* arena, GoInt* offsets);
+extern GoInt DecompressBatch(GoString* srcs, GoInt n, GoString dict, GoBatchArena* arena, GoInt* offsets);
+extern void ReleaseBatchArena(GoBatchArena* arena);
+
 extern struct GoCompressResult CompressWithDict(GoString src, GoString dict);
+
+/* CompressSmall is meant for payloads of a few hundred bytes. It returns
+ * {NULL, 0} for inputs shorter than the passThrough of SetSmallMode, the
+ * caller then sends them as is. Frames carry neither the content size nor
+ * the dictID, nor the magic number when magicless is set, so they are read
+ * back with DecompressSmall, the same dict and the same mode. dict may be
+ * empty.
+ */
+extern void SetSmallMode(GoInt passThrough, GoInt magicless);
+extern struct GoCompressResult CompressSmall(GoString src, GoString dict);
+extern struct GoDecompressResult DecompressSmall(GoString src, GoString dict);
+
+/* CompressToBase64 compresses, with dict when given, and base64 encodes the
+ * frame in the same buffer. flags is 0 for 72-column lines as base64_encode
+ * writes them, 1 for URL-safe without padding or line feeds, 2 for the
+ * standard alphabet on a single line. DecompressFromBase64 accepts any of
+ * them.
+ */
+extern struct GoCompressResult CompressToBase64(GoString src, GoString dict, GoInt flags);
+extern struct GoDecompressResult DecompressFromBase64(GoString src, GoString dict);
+
+/* CompressSeekable writes independent frames of frameSize input bytes plus a
+ * seek table, so that DecompressRange only decodes the frames overlapping
+ * [offset, offset+length). The range is clamped to the decompressed size.
+ */
+extern struct GoCompressResult CompressSeekable(GoString src, GoInt frameSize);
+extern struct GoDecompressResult DecompressRange(GoString src, GoInt offset, GoInt length);
+/* CompressWithParams/CompressWithDictAndParams return {NULL, 0} when the
+ * maxRatio of the params is exceeded, the caller then sends the input as is.
+ */
+extern struct GoCompressResult CompressWithParams(GoString src, GoString params);
+extern struct GoCompressResult CompressWithDictAndParams(GoString src, GoString dict, GoString params);
+
+/* Streaming compression for chunked bodies. flushMode follows
+ * ZSTD_EndDirective: 0 continue, 1 flush, 2 end. The data returned by
+ * CompressStreamFeed is owned by the stream and stays valid until the next
+ * Feed or End call, so it must not be freed by the caller.
+ */
+extern void* CompressStreamBegin(GoInt level, GoString dict);
+extern struct GoCompressResult CompressStreamFeed(void* stream, GoString chunk, GoInt flushMode);
+extern void CompressStreamEnd(void* stream);
+
+/* Streaming decompression for chunked bodies. As with CompressStreamFeed the
+ * returned data is owned by the stream until the next Feed or End call.
+ * maxOutput bounds what a single Feed may produce, 0 meaning streamHintMax:
+ * a chunk whose output reaches it fails with -1 and the stream must be ended.
+ */
+extern void* DecompressStreamBegin(GoString dict, GoInt maxOutput);
+extern struct GoDecompressResult DecompressStreamFeed(void* stream, GoString chunk);
+extern void DecompressStreamEnd(void* stream);
 extern struct GoDecompressResult DecompressWithDict(GoString dst, GoString dict);
 extern struct GoDecompressResult StreamDecompressWithDict(GoString dst, GoString dict);
+extern struct GoDecompressResult DecompressAuto(GoString dst);
 
 /*! LOGF
  * println logs
@@ -284,6 +680,22 @@ static void* malloc_orDie(size_t size)
     exit(ERROR_malloc);
 }
 
+/*! realloc_orDie() :
+ * Resize allocated memory.
+ *
+ * @return If successful this function returns a pointer to the resized
+ * memory.  If there is an error, this function will send that error to
+ * stderr and exit.
+ */
+static void* realloc_orDie(void* ptr, size_t size)
+{
+    void* const buff = realloc(ptr, size);
+    if (buff) return buff;
+    /* error */
+    perror("realloc");
+    exit(ERROR_malloc);
+}
+
 /*! mallocAndLoadFile_orDie() :
  * allocate memory buffer and then load file into it.
  *
@@ -301,76 +713,1596 @@ static void* mallocAndLoadFile_orDie(const char* fileName, size_t* bufferSize) {
     return buffer;
 }
 
-/* createCDict_orDie() :
-   `dictFileName` is supposed to have been created using `zstd --train` */
-static ZSTD_CDict* createCDict_orDie(const char* dictFileName, int cLevel)
+/*! loadDictFile_orDie() :
+ * Read a dictionary file once. Files of at least dictMmapMin bytes are mapped
+ * read-only instead of being copied into a malloc'ed buffer.
+ *
+ * Note: This function will send an error to stderr and exit if it cannot
+ * read data from the given file path.
+ *
+ * @return The file content, to be given back with unloadDictFile().
+ */
+static void* loadDictFile_orDie(const char* fileName, size_t* bufferSize, int* mapped)
+{
+    size_t const fileSize = fsize_orDie(fileName);
+
+    *mapped = 0;
+    if (fileSize >= dictMmapMin)
+    {
+        int const fd = open(fileName, O_RDONLY);
+        if (fd >= 0)
+        {
+            void* const buffer = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+
+            if (buffer != MAP_FAILED)
+            {
+                *bufferSize = fileSize;
+                *mapped = 1;
+
+                return buffer;
+            }
+        }
+    }
+
+    return mallocAndLoadFile_orDie(fileName, bufferSize);
+}
+
+static void unloadDictFile(void* buffer, size_t bufferSize, int mapped)
 {
-    printf("loading dictionary %s \n", dictFileName);
+    if (mapped)
+    {
+        munmap(buffer, bufferSize);
+    }
+    else
+    {
+        free(buffer);
+    }
+}
+
+/*! is_raw_dict() :
+ * Tell raw `zstd --train` output, which starts with ZSTD_MAGIC_DICTIONARY,
+ * from its base64 encoded form.
+ */
+static int is_raw_dict(const void* buffer, size_t bufferSize)
+{
+    const unsigned char* const p = (const unsigned char*)buffer;
+    if (bufferSize < 4)
+    {
+        return 0;
+    }
+
+    unsigned const magic = (unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+
+    return magic == ZSTD_MAGIC_DICTIONARY;
+}
+
+/*! hash_key() :
+ * FNV-1a hash of a dictionary name.
+ */
+static GoUint64 hash_key(const char* p, size_t n)
+{
+    GoUint64 h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
 
-    size_t fileSize, dictSize;
-    void* const fileBuffer = mallocAndLoadFile_orDie(dictFileName, &fileSize);
-    unsigned char* dictBuffer = base64_decode(fileBuffer, fileSize, &dictSize);
+    return h;
+}
+
+static GoUint64 dict_id_hash(unsigned dictID)
+{
+    return hash_key((const char*)&dictID, sizeof(dictID));
+}
+
+/*! retain_dict() :
+ * Take a reference on a dictionary so that it outlives a ReplaceDict or
+ * RemoveDict issued while it is still in use.
+ */
+static GoDict* retain_dict(GoDict* entry)
+{
+    if (entry != NULL)
+    {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL);
+    }
+
+    return entry;
+}
 
-    ZSTD_CDict* const cdict = ZSTD_createCDict(dictBuffer, dictSize, cLevel);
-    CHECK(cdict != NULL, "ZSTD_createCDict() failed!");
-    free(dictBuffer);
+/*! release_dict() :
+ * Drop a reference on a dictionary, freeing it with the last one.
+ */
+static void release_dict(GoDict* entry)
+{
+    if (entry == NULL || __atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
 
-    return cdict;
+    if (isDebug == 1)
+    {
+        LOGF("[DEBUG] free dict(%s) ...", entry->key);
+    }
+    /* Shared dictionaries may sit in read-only memory and are never freed. */
+    if (!entry->shared)
+    {
+        ZSTD_freeCDict(entry->cdict);
+        ZSTD_freeDDict(entry->ddict);
+    }
+    free(entry->key);
+    free(entry);
 }
 
-static ZSTD_CDict* load_cdict(GoString dict)
+/*! find_dict() :
+ * Probe the name table for a dictionary. Only the writer, or a reader
+ * counted in dictReaders, may call it.
+ */
+static GoDict* find_dict(GoString dict)
 {
-    if (dict.n <= 0)
+    GoDictTable* const table = __atomic_load_n(&globalDicts.table, __ATOMIC_SEQ_CST);
+    if (dict.n <= 0 || table == NULL)
     {
         return NULL;
     }
 
-    int i;
-    for (i = 0; i < globalCDicts.len; i++)
+    size_t const n = (size_t)dict.n;
+    GoUint64 const h = hash_key(dict.p, n);
+    size_t const mask = table->cap - 1;
+
+    size_t i;
+    GoDict* entry;
+    for (i = h & mask; (entry = __atomic_load_n(&table->slots[i], __ATOMIC_SEQ_CST)) != NULL; i = (i + 1) & mask)
     {
-        if ((globalCDicts.cdicts[i].key.n == dict.n) && strcmp(globalCDicts.cdicts[i].key.p, dict.p) == 0)
+        if (entry->hash == h && entry->keyLen == n && memcmp(entry->key, dict.p, n) == 0)
         {
-            return globalCDicts.cdicts[i].cdict;
+            return entry;
         }
     }
 
     return NULL;
 }
 
-/* createDict_orDie() :
-   `dictFileName` is supposed to have been created using `zstd --train` */
-static ZSTD_DDict* createDDict_orDie(const char* dictFileName)
+/*! find_dict_by_id() :
+ * Probe the dictID table, under the same rules as find_dict(). Raw content
+ * dictionaries have no ID and are never found here.
+ */
+static GoDict* find_dict_by_id(unsigned dictID)
 {
-    printf("loading dictionary %s \n", dictFileName);
+    GoDictTable* const table = __atomic_load_n(&globalDicts.table, __ATOMIC_SEQ_CST);
+    if (dictID == 0 || table == NULL)
+    {
+        return NULL;
+    }
+
+    size_t const mask = table->cap - 1;
+
+    size_t i;
+    GoDict* entry;
+    for (i = dict_id_hash(dictID) & mask; (entry = __atomic_load_n(&table->idSlots[i], __ATOMIC_SEQ_CST)) != NULL; i = (i + 1) & mask)
+    {
+        if (entry->dictID == dictID)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*! load_dict() :
+ * Look up a dictionary by name and take a reference on it, which the caller
+ * drops with release_dict() once it is done with the entry.
+ *
+ * @return The registered dictionary, or NULL if there is none.
+ */
+static GoDict* load_dict(GoString dict)
+{
+    __atomic_add_fetch(&dictReaders, 1, __ATOMIC_SEQ_CST);
+    GoDict* const entry = retain_dict(find_dict(dict));
+    __atomic_sub_fetch(&dictReaders, 1, __ATOMIC_SEQ_CST);
+
+    return entry;
+}
+
+/*! load_dict_by_id() :
+ * Look up a dictionary by the dictID stored in its header, with a reference
+ * taken as by load_dict().
+ *
+ * @return The registered dictionary, or NULL if there is none.
+ */
+static GoDict* load_dict_by_id(unsigned dictID)
+{
+    __atomic_add_fetch(&dictReaders, 1, __ATOMIC_SEQ_CST);
+    GoDict* const entry = retain_dict(find_dict_by_id(dictID));
+    __atomic_sub_fetch(&dictReaders, 1, __ATOMIC_SEQ_CST);
+
+    return entry;
+}
+
+/*! index_dict_id() :
+ * Put an entry into the dictID table unless its dictID is already indexed,
+ * in which case the entry stays reachable by name only.
+ */
+static void index_dict_id(GoDictTable* table, GoDict* entry)
+{
+    if (entry->dictID == 0)
+    {
+        return;
+    }
+
+    size_t const mask = table->cap - 1;
+
+    size_t i;
+    for (i = dict_id_hash(entry->dictID) & mask; table->idSlots[i] != NULL; i = (i + 1) & mask)
+    {
+        if (table->idSlots[i]->dictID == entry->dictID)
+        {
+            return;
+        }
+    }
+    __atomic_store_n(&table->idSlots[i], entry, __ATOMIC_SEQ_CST);
+}
+
+/*! insert_dict_slots() :
+ * Put an entry into both tables, which must have a free slot.
+ */
+static void insert_dict_slots(GoDictTable* table, GoDict* entry)
+{
+    size_t const mask = table->cap - 1;
+
+    size_t i;
+    for (i = entry->hash & mask; table->slots[i] != NULL; i = (i + 1) & mask);
+    __atomic_store_n(&table->slots[i], entry, __ATOMIC_SEQ_CST);
 
-    size_t fileSize, dictSize;
-    void* const fileBuffer = mallocAndLoadFile_orDie(dictFileName, &fileSize);
-    unsigned char* dictBuffer = base64_decode(fileBuffer, fileSize, &dictSize); 
+    index_dict_id(table, entry);
+}
+
+/*! rehash_dicts() :
+ * Publish a new table of capacity cap holding every registered entry but
+ * skip, and retire the current one. Readers probe either table, never one
+ * with slots being moved around.
+ */
+static void rehash_dicts(size_t cap, GoDict* skip)
+{
+    GoDictTable* const table = malloc_orDie(sizeof(GoDictTable));
+    table->cap = cap;
+    table->slots = calloc(cap, sizeof(GoDict*));
+    table->idSlots = calloc(cap, sizeof(GoDict*));
+    table->retired = NULL;
+    if (table->slots == NULL || table->idSlots == NULL)
+    {
+        perror("calloc");
+        exit(ERROR_malloc);
+    }
+
+    GoDictTable* const old = globalDicts.table;
+    if (old != NULL)
+    {
+        size_t i;
+        for (i = 0; i < old->cap; i++)
+        {
+            if (old->slots[i] != NULL && old->slots[i] != skip)
+            {
+                insert_dict_slots(table, old->slots[i]);
+            }
+        }
+
+        old->retired = globalDicts.retiredTables;
+        globalDicts.retiredTables = old;
+    }
+
+    __atomic_store_n(&globalDicts.table, table, __ATOMIC_SEQ_CST);
+}
+
+/*! retire_dict() :
+ * Hand the registry reference of an unlinked entry to reclaim_dicts(), and
+ * drop the outputs cached for it. Other threads cannot hit theirs anymore,
+ * the generation being gone for good, and evict them as they age.
+ */
+static void cache_drop(GoUint64 generation);
+
+static void retire_dict(GoDict* entry)
+{
+    cache_drop(entry->generation);
+
+    entry->retired = globalDicts.retiredDicts;
+    globalDicts.retiredDicts = entry;
+}
+
+/*! reclaim_dicts() :
+ * Drop the registry references of retired entries and free retired tables,
+ * provided no reader is probing: a reader counted after this check can only
+ * find what is currently published. Otherwise the next registry change
+ * tries again.
+ */
+static void reclaim_dicts()
+{
+    if (__atomic_load_n(&dictReaders, __ATOMIC_SEQ_CST) != 0)
+    {
+        return;
+    }
+
+    while (globalDicts.retiredDicts != NULL)
+    {
+        GoDict* const entry = globalDicts.retiredDicts;
+        globalDicts.retiredDicts = entry->retired;
+        release_dict(entry);
+    }
+
+    while (globalDicts.retiredTables != NULL)
+    {
+        GoDictTable* const table = globalDicts.retiredTables;
+        globalDicts.retiredTables = table->retired;
+        free(table->slots);
+        free(table->idSlots);
+        free(table);
+    }
+}
 
-    ZSTD_DDict* const ddict = ZSTD_createDDict(dictBuffer, dictSize);
-    CHECK(ddict != NULL, "ZSTD_createDDict() failed!");
-    free(dictBuffer);
+/*! store_dict() :
+ * Register a dictionary, doubling the tables once they are 3/4 full so that
+ * probe sequences stay short.
+ */
+static void store_dict(GoDict* entry)
+{
+    GoDictTable* const table = globalDicts.table;
+    if (table == NULL || (globalDicts.len + 1) * 4 > table->cap * 3)
+    {
+        rehash_dicts(table == NULL ? dictInitCap : table->cap * 2, NULL);
+    }
+
+    insert_dict_slots(globalDicts.table, entry);
+    globalDicts.len++;
+
+    reclaim_dicts();
+}
+
+/*! unstore_dict() :
+ * Unregister a dictionary. Calls in flight keep the references they took
+ * and finish on it.
+ */
+static void unstore_dict(GoDict* old)
+{
+    rehash_dicts(globalDicts.table->cap, old);
+    globalDicts.len--;
 
-    return ddict;
+    retire_dict(old);
+    reclaim_dicts();
 }
 
-static ZSTD_DDict* load_ddict(GoString dict)
+/*! shared_arena_alloc() :
+ * ZSTD_customMem allocation function of the shared dictionary arena. Memory
+ * is handed out in 64-byte aligned slices of MAP_SHARED anonymous chunks.
+ * A forked child would hand out the same offsets as its siblings, so it may
+ * not allocate from chunks its parent mapped.
+ *
+ * @return The allocated memory, or NULL once the arena is frozen or full, or
+ *         in a process other than the one that mapped it.
+ */
+static void* shared_arena_alloc(void* opaque, size_t size)
 {
-    if (dict.n <= 0)
+    SharedDictArena* const arena = (SharedDictArena*)opaque;
+    size_t const aligned = (size + 63) & ~(size_t)63;
+
+    if (arena->frozen)
+    {
+        return NULL;
+    }
+    if (CHECK(arena->len == 0 || arena->pid == getpid(), "shared dict arena belongs to process %d",
+              (int)arena->pid) != 0)
     {
         return NULL;
     }
 
-    int i;
-    for (i = 0; i < globalDDicts.len; i++)
+    if (arena->len == 0 || arena->used + aligned > arena->chunks[arena->len-1].size)
     {
-        if ((globalDDicts.ddicts[i].key.n == dict.n) && strcmp(globalDDicts.ddicts[i].key.p, dict.p) == 0)
+        if (CHECK(arena->len < sharedDictChunksLen, "shared dict arena is full") != 0)
+        {
+            return NULL;
+        }
+
+        size_t const chunkSize = aligned > sharedDictChunkSize ? aligned : sharedDictChunkSize;
+        void* const base = mmap(NULL, chunkSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (CHECK(base != MAP_FAILED, "mmap of shared dict arena failed: %s", strerror(errno)) != 0)
         {
-            return globalDDicts.ddicts[i].ddict;
+            return NULL;
         }
+
+        arena->chunks[arena->len].base = base;
+        arena->chunks[arena->len].size = chunkSize;
+        arena->len++;
+        arena->used = 0;
+        arena->pid = getpid();
     }
 
-    return NULL;
+    void* const ptr = arena->chunks[arena->len-1].base + arena->used;
+    arena->used += aligned;
+
+    return ptr;
+}
+
+/*! shared_arena_free() :
+ * Shared dictionaries live as long as the process, so frees are ignored.
+ */
+static void shared_arena_free(void* opaque, void* address)
+{
+    (void)opaque;
+    (void)address;
+}
+
+/*! createDict() :
+ * Build the CDict and DDict of a dictionary from a single buffer, decoding it
+ * first when isBase64 is set. zstd copies the content, so the buffer may be
+ * released once this returns. A shared dictionary copies the content into
+ * the shared arena once and digests it there by reference. The returned
+ * entry holds a single reference, owned by the caller.
+ *
+ * @return The new entry, or NULL if the content is not a valid dictionary.
+ */
+static GoDict* createDict(GoString name, const void* buffer, size_t bufferSize, int isBase64, int cLevel, int shared)
+{
+    const void* dictBuffer = buffer;
+    size_t dictSize = bufferSize;
+
+    unsigned char* decoded = NULL;
+    if (isBase64)
+    {
+        decoded = base64_decode(buffer, bufferSize, &dictSize);
+        if (CHECK(decoded != NULL, "invalid base64 dict: key=%.*s", (int)name.n, name.p) != 0)
+        {
+            return NULL;
+        }
+        dictBuffer = decoded;
+    }
+
+    ZSTD_CDict* cdict = NULL;
+    ZSTD_DDict* ddict = NULL;
+    if (shared)
+    {
+        ZSTD_customMem const sharedMem = { shared_arena_alloc, shared_arena_free, &sharedDictArena };
+
+        void* const content = shared_arena_alloc(&sharedDictArena, dictSize);
+        if (content != NULL)
+        {
+            memcpy(content, dictBuffer, dictSize);
+
+            cdict = ZSTD_createCDict_advanced(content, dictSize, ZSTD_dlm_byRef, ZSTD_dct_auto,
+                                              ZSTD_getCParams(cLevel, 0, dictSize), sharedMem);
+            ddict = ZSTD_createDDict_advanced(content, dictSize, ZSTD_dlm_byRef, ZSTD_dct_auto, sharedMem);
+        }
+    }
+    else
+    {
+        cdict = ZSTD_createCDict(dictBuffer, dictSize, cLevel);
+        ddict = ZSTD_createDDict(dictBuffer, dictSize);
+    }
+    free(decoded);
+
+    if (CHECK(cdict != NULL && ddict != NULL, "ZSTD_createCDict()/ZSTD_createDDict() failed!") != 0)
+    {
+        if (!shared)
+        {
+            ZSTD_freeCDict(cdict);
+            ZSTD_freeDDict(ddict);
+        }
+
+        return NULL;
+    }
+
+    GoDict* const entry = malloc_orDie(sizeof(GoDict));
+    entry->key = malloc_orDie(name.n + 1);
+    memcpy(entry->key, name.p, name.n);
+    entry->key[name.n] = '\0';
+    entry->keyLen = (size_t)name.n;
+    entry->hash = hash_key(name.p, (size_t)name.n);
+    entry->level = cLevel;
+    entry->refs = 1;
+    entry->shared = shared;
+    entry->cdict = cdict;
+    entry->ddict = ddict;
+    entry->dictID = ZSTD_getDictID_fromDDict(ddict);
+    entry->generation = __atomic_add_fetch(&dictGenerations, 1, __ATOMIC_RELAXED);
+    memset(&entry->counters, 0, sizeof(GoDictCounters));
+
+    return entry;
+}
+
+/*! createDictFromFile_orDie() :
+ * Build a dictionary from a file, which is either raw `zstd --train` output
+ * or its base64 encoding. The file is read once for both the CDict and DDict.
+ *
+ * @return The new entry, or NULL if the content is not a valid dictionary.
+ */
+static GoDict* createDictFromFile_orDie(GoString name, const char* dictFileName, int cLevel, int shared)
+{
+    printf("loading dictionary %s \n", dictFileName);
+
+    size_t fileSize;
+    int mapped;
+    void* const fileBuffer = loadDictFile_orDie(dictFileName, &fileSize, &mapped);
+
+    GoDict* const entry = createDict(name, fileBuffer, fileSize, !is_raw_dict(fileBuffer, fileSize), cLevel, shared);
+    unloadDictFile(fileBuffer, fileSize, mapped);
+
+    return entry;
+}
+
+/*! swap_dict() :
+ * Swap a registered entry in place: lookups see either the old or the new
+ * one, and calls or streams still holding the old entry finish on it.
+ */
+static void swap_dict(GoDict* old, GoDict* entry)
+{
+    GoDictTable* const table = globalDicts.table;
+    size_t const mask = table->cap - 1;
+
+    size_t i;
+    for (i = old->hash & mask; table->slots[i] != old; i = (i + 1) & mask);
+    __atomic_store_n(&table->slots[i], entry, __ATOMIC_SEQ_CST);
+
+    if (old->dictID != entry->dictID)
+    {
+        /* Index the new dictID, and let another entry take over the old one */
+        rehash_dicts(table->cap, NULL);
+    }
+    else if (old->dictID != 0)
+    {
+        for (i = dict_id_hash(old->dictID) & mask; table->idSlots[i] != NULL; i = (i + 1) & mask)
+        {
+            if (table->idSlots[i] == old)
+            {
+                __atomic_store_n(&table->idSlots[i], entry, __ATOMIC_SEQ_CST);
+                break;
+            }
+        }
+    }
+
+    retire_dict(old);
+    reclaim_dicts();
+}
+
+/*! train_dict() :
+ * Thread body of TrainDict. The job is queued on trainedDicts whether the
+ * training succeeded or not, with a NULL dict on failure.
+ */
+static void* train_dict(void* arg)
+{
+    GoTrainJob* const job = arg;
+    GoTrainParams const* const params = &job->params;
+
+    ZDICT_params_t const zParams = { (int)params->level, 0, 0 };
+
+    size_t dictSize;
+    if (params->optimize)
+    {
+        ZDICT_cover_params_t cover = {};
+        cover.k = (unsigned)params->k;
+        cover.d = (unsigned)params->d;
+        cover.steps = (unsigned)params->steps;
+        cover.nbThreads = 1;
+        cover.zParams = zParams;
+
+        dictSize = ZDICT_optimizeTrainFromBuffer_cover(job->dict, job->dictSize, job->samples, job->sampleSizes, job->n, &cover);
+    }
+    else
+    {
+        ZDICT_fastCover_params_t fastCover = {};
+        fastCover.k = (unsigned)params->k;
+        fastCover.d = (unsigned)params->d;
+        fastCover.steps = (unsigned)params->steps;
+        fastCover.nbThreads = 1;
+        fastCover.zParams = zParams;
+
+        if (fastCover.k > 0 && fastCover.d > 0)
+        {
+            dictSize = ZDICT_trainFromBuffer_fastCover(job->dict, job->dictSize, job->samples, job->sampleSizes, job->n, fastCover);
+        }
+        else
+        {
+            fastCover.d = fastCover.d > 0 ? fastCover.d : 8;
+            fastCover.steps = fastCover.steps > 0 ? fastCover.steps : 4;
+
+            dictSize = ZDICT_optimizeTrainFromBuffer_fastCover(job->dict, job->dictSize, job->samples, job->sampleSizes, job->n, &fastCover);
+        }
+    }
+
+    if (ZDICT_isError(dictSize))
+    {
+        LOGF("[TrainDict] %.*s : %s", (int)job->name.n, job->name.p, ZDICT_getErrorName(dictSize));
+
+        free(job->dict);
+        job->dict = NULL;
+    }
+    job->dictSize = dictSize;
+
+    free(job->samples);
+    free(job->sampleSizes);
+    job->samples = NULL;
+    job->sampleSizes = NULL;
+
+    pthread_mutex_lock(&trainLock);
+    job->next = trainedDicts;
+    __atomic_store_n(&trainedDicts, job, __ATOMIC_RELEASE);
+    trainRunning--;
+    pthread_cond_broadcast(&trainCond);
+    pthread_mutex_unlock(&trainLock);
+
+    return NULL;
+}
+
+/*! install_trained_dicts() :
+ * Register the dictionaries queued by finished trainings.
+ *
+ * @return The number of dictionaries registered.
+ */
+static int install_trained_dicts()
+{
+    pthread_mutex_lock(&trainLock);
+    GoTrainJob* job = trainedDicts;
+    __atomic_store_n(&trainedDicts, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trainLock);
+
+    int installed = 0;
+    while (job != NULL)
+    {
+        GoTrainJob* const next = job->next;
+
+        GoDict* const entry = job->dict != NULL ? createDict(job->name, job->dict, job->dictSize, 0, (int)job->params.level, 0) : NULL;
+        if (entry != NULL)
+        {
+            LOGF("[INFO] add trained dict(%.*s), size=%zu ...", (int)job->name.n, job->name.p, job->dictSize);
+
+            GoDict* const old = find_dict(job->name);
+            if (old != NULL)
+            {
+                swap_dict(old, entry);
+            }
+            else
+            {
+                store_dict(entry);
+            }
+            installed++;
+        }
+
+        free(job->dict);
+        free((void*)job->name.p);
+        free(job);
+
+        job = next;
+    }
+
+    return installed;
+}
+
+/*! load_params() :
+ * Look up params by name.
+ *
+ * @return The registered params, or NULL if there are none.
+ */
+static GoCompressParams* load_params(GoString params)
+{
+    GoParamsTable* const table = __atomic_load_n(&globalParams.table, __ATOMIC_ACQUIRE);
+    if (params.n <= 0 || table == NULL)
+    {
+        return NULL;
+    }
+
+    size_t const n = (size_t)params.n;
+    GoUint64 const h = hash_key(params.p, n);
+    size_t const mask = table->cap - 1;
+
+    size_t i;
+    GoParams* entry;
+    for (i = h & mask; (entry = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE)) != NULL; i = (i + 1) & mask)
+    {
+        if (entry->hash == h && entry->keyLen == n && memcmp(entry->key, params.p, n) == 0)
+        {
+            return &entry->params;
+        }
+    }
+
+    return NULL;
+}
+
+/*! insert_params_slot() :
+ * Put an entry into a table, which must have a free slot.
+ */
+static void insert_params_slot(GoParamsTable* table, GoParams* entry)
+{
+    size_t const mask = table->cap - 1;
+
+    size_t i;
+    for (i = entry->hash & mask; table->slots[i] != NULL; i = (i + 1) & mask);
+    __atomic_store_n(&table->slots[i], entry, __ATOMIC_RELEASE);
+}
+
+/*! store_params() :
+ * Register params, doubling the table once it is 3/4 full. The outgrown
+ * table is kept for readers still probing it.
+ */
+static void store_params(GoParams* entry)
+{
+    GoParamsTable* const old = globalParams.table;
+    if (old == NULL || (globalParams.len + 1) * 4 > old->cap * 3)
+    {
+        GoParamsTable* const table = malloc_orDie(sizeof(GoParamsTable));
+        table->cap = old == NULL ? paramsInitCap : old->cap * 2;
+        table->slots = calloc(table->cap, sizeof(GoParams*));
+        table->retired = old;
+        if (table->slots == NULL)
+        {
+            perror("calloc");
+            exit(ERROR_malloc);
+        }
+
+        if (old != NULL)
+        {
+            size_t i;
+            for (i = 0; i < old->cap; i++)
+            {
+                if (old->slots[i] != NULL)
+                {
+                    insert_params_slot(table, old->slots[i]);
+                }
+            }
+        }
+
+        __atomic_store_n(&globalParams.table, table, __ATOMIC_RELEASE);
+    }
+
+    insert_params_slot(globalParams.table, entry);
+    globalParams.len++;
+}
+
+/*! apply_params() :
+ * Set every field of a parameter set on a compression context. nbWorkers and
+ * jobSize are rejected unless libzstd is built with ZSTD_MULTITHREAD, in which
+ * case they are skipped and compression stays single-threaded.
+ *
+ * @return 0 on success, or -1 when zstd rejects one of the values.
+ */
+static int apply_params(ZSTD_CCtx* cctx, const GoCompressParams* params)
+{
+    if (CHECK_ZSTD(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, (int)params->level)) != 0 ||
+        CHECK_ZSTD(ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, (int)params->windowLog)) != 0 ||
+        CHECK_ZSTD(ZSTD_CCtx_setParameter(cctx, ZSTD_c_strategy, (int)params->strategy)) != 0 ||
+        CHECK_ZSTD(ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, (int)params->checksumFlag)) != 0 ||
+        CHECK_ZSTD(ZSTD_CCtx_setParameter(cctx, ZSTD_c_contentSizeFlag, params->noContentSize == 0)) != 0)
+    {
+        return -1;
+    }
+
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, (int)params->nbWorkers)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_jobSize, (int)params->jobSize)))
+    {
+        if (isDebug == 1)
+        {
+            LOGF("[DEBUG] multithreading is unsupported, nbWorkers=%lld ignored", params->nbWorkers);
+        }
+    }
+
+    return 0;
+}
+
+/*! compress_bounded() :
+ * Compress src one block at a time, flushing after each, and give up as soon
+ * as the output exceeds maxRatio per-mille of the input consumed so far. Up to
+ * a frame header of slack is allowed before the last block, the complete
+ * frame has to fit the ratio exactly.
+ *
+ * @return The compressed size, 0 when compression was given up, or an error
+ *         code, which can be tested using ZSTD_isError().
+ */
+static size_t compress_bounded(ZSTD_CCtx* cctx, void* dst, size_t dstCapacity, const void* src, size_t srcSize, GoInt maxRatio)
+{
+    size_t const err = ZSTD_CCtx_setPledgedSrcSize(cctx, srcSize);
+    if (ZSTD_isError(err))
+    {
+        return err;
+    }
+
+    ZSTD_outBuffer output = { dst, dstCapacity, 0 };
+    ZSTD_inBuffer input = { src, 0, 0 };
+    for (;;)
+    {
+        input.size = srcSize - input.size > ZSTD_BLOCKSIZE_MAX ? input.size + ZSTD_BLOCKSIZE_MAX : srcSize;
+        ZSTD_EndDirective const mode = input.size == srcSize ? ZSTD_e_end : ZSTD_e_flush;
+
+        size_t remaining;
+        do
+        {
+            remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+            if (ZSTD_isError(remaining))
+            {
+                return remaining;
+            }
+            if (output.pos == output.size && (remaining != 0 || input.pos < input.size))
+            {
+                return 0;
+            }
+        } while (remaining != 0 || input.pos < input.size);
+
+        size_t const limit = (size_t)((GoUint64)input.pos * (GoUint64)maxRatio / 1000);
+        if (mode == ZSTD_e_end)
+        {
+            return output.pos > limit ? 0 : output.pos;
+        }
+        if (output.pos > limit + ZSTD_FRAMEHEADERSIZE_MAX)
+        {
+            return 0;
+        }
+    }
+}
+
+/*! small_params() :
+ * Prepare a compression context for CompressSmall: no content size or dictID
+ * in the frame header, the magicless format when SetSmallMode asked for it,
+ * and the source size pledged so that tiny inputs get tiny tables.
+ *
+ * @return 0 on success, or -1 when zstd rejects one of the values.
+ */
+static int small_params(ZSTD_CCtx* cctx, GoDict* entry, size_t srcSize)
+{
+    ZSTD_format_e const format = __atomic_load_n(&smallMagicless, __ATOMIC_RELAXED) ? ZSTD_f_zstd1_magicless : ZSTD_f_zstd1;
+
+    if (CHECK_ZSTD(ZSTD_CCtx_setParameter(cctx, ZSTD_c_contentSizeFlag, 0)) != 0 ||
+        CHECK_ZSTD(ZSTD_CCtx_setParameter(cctx, ZSTD_c_dictIDFlag, 0)) != 0 ||
+        CHECK_ZSTD(ZSTD_CCtx_setParameter(cctx, ZSTD_c_format, format)) != 0 ||
+        CHECK_ZSTD(ZSTD_CCtx_setPledgedSrcSize(cctx, srcSize)) != 0)
+    {
+        return -1;
+    }
+
+    if (entry != NULL && CHECK_ZSTD(ZSTD_CCtx_refCDict(cctx, entry->cdict), "cannot init dict for compress") != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*! stream_decompress_hint() :
+ * Initial output capacity for streaming decompression. It uses the upper bound
+ * from ZSTD_decompressBound(), capped by streamHintMax so that a small frame
+ * declaring many blocks cannot reserve a huge buffer up-front.
+ *
+ * @return The initial capacity, never less than ZSTD_DStreamOutSize().
+ */
+static size_t stream_decompress_hint(const void* src, size_t srcSize)
+{
+    size_t const minHint = ZSTD_DStreamOutSize();
+    unsigned long long const bound = ZSTD_decompressBound(src, srcSize);
+    if (bound == ZSTD_CONTENTSIZE_ERROR || bound < minHint)
+    {
+        return minHint;
+    }
+    if (bound > streamHintMax)
+    {
+        return streamHintMax;
+    }
+
+    return (size_t)bound;
+}
+
+/*! load_reservoir() :
+ * Look up the reservoir of a key, creating it when create is set. Must be
+ * called with samplerLock held.
+ */
+static GoReservoir* load_reservoir(GoString key, int create)
+{
+    size_t const n = key.n > 0 ? (size_t)key.n : 0;
+    GoUint64 const h = hash_key(key.p, n);
+
+    GoReservoir* reservoir;
+    for (reservoir = sampler.reservoirs; reservoir != NULL; reservoir = reservoir->next)
+    {
+        if (reservoir->hash == h && reservoir->keyLen == n && memcmp(reservoir->key, key.p, n) == 0)
+        {
+            return reservoir;
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+
+    reservoir = malloc_orDie(sizeof(GoReservoir));
+    reservoir->key = malloc_orDie(n + 1);
+    memcpy(reservoir->key, key.p, n);
+    reservoir->key[n] = '\0';
+    reservoir->keyLen = n;
+    reservoir->hash = h;
+    reservoir->seen = 0;
+    reservoir->samples = malloc_orDie(sampler.maxSamples * sizeof(GoSample));
+    reservoir->len = 0;
+    reservoir->next = sampler.reservoirs;
+    sampler.reservoirs = reservoir;
+
+    return reservoir;
+}
+
+/*! sample_input() :
+ * Offer an input to the reservoir of key (algorithm R): the first maxSamples
+ * inputs are kept, then the n-th replaces a random sample with probability
+ * maxSamples/n. Samples that would exceed the memory cap are dropped.
+ */
+static void sample_input(GoString key, GoString src)
+{
+    if (src.n <= 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&samplerLock);
+    if (!sampler.enabled)
+    {
+        pthread_mutex_unlock(&samplerLock);
+
+        return;
+    }
+
+    GoReservoir* const reservoir = load_reservoir(key, 1);
+    reservoir->seen++;
+
+    int slot = reservoir->len;
+    if (slot >= sampler.maxSamples)
+    {
+        /* xorshift64 */
+        sampler.rand ^= sampler.rand << 13;
+        sampler.rand ^= sampler.rand >> 7;
+        sampler.rand ^= sampler.rand << 17;
+
+        GoUint64 const j = sampler.rand % reservoir->seen;
+        slot = j < (GoUint64)sampler.maxSamples ? (int)j : -1;
+    }
+
+    size_t const size = (size_t)src.n < sampler.maxSampleSize ? (size_t)src.n : sampler.maxSampleSize;
+    size_t const freed = slot >= 0 && slot < reservoir->len ? reservoir->samples[slot].size : 0;
+    if (slot >= 0 && sampler.used - freed + size <= sampler.cap)
+    {
+        if (slot < reservoir->len)
+        {
+            free(reservoir->samples[slot].data);
+        }
+        else
+        {
+            reservoir->len++;
+        }
+
+        reservoir->samples[slot].data = malloc_orDie(size);
+        reservoir->samples[slot].size = size;
+        memcpy(reservoir->samples[slot].data, src.p, size);
+
+        sampler.used = sampler.used - freed + size;
+    }
+
+    pthread_mutex_unlock(&samplerLock);
+}
+
+static GoUint64 stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (GoUint64)ts.tv_sec * 1000000000 + (GoUint64)ts.tv_nsec;
+}
+
+/*! stats_record() :
+ * Account one call of an operation started at start. A negative outSize
+ * counts the call as an error.
+ */
+static void stats_record(GoOpStats* op, GoUint64 start, GoInt inSize, GoInt outSize)
+{
+    op->calls++;
+    if (outSize < 0)
+    {
+        op->errors++;
+
+        return;
+    }
+
+    GoUint64 const elapsed = stats_now() - start;
+
+    int size = 0;
+    while (size < statsBuckets - 1 && (GoUint64)inSize >= (GoUint64)256 << (2 * size))
+    {
+        size++;
+    }
+    int time = 0;
+    while (time < statsBuckets - 1 && elapsed >= (GoUint64)1000 << (2 * time))
+    {
+        time++;
+    }
+
+    op->bytesIn += (GoUint64)inSize;
+    op->bytesOut += (GoUint64)outSize;
+    op->latencyNs += elapsed;
+    op->latency[size][time]++;
+}
+
+/*! stats_into() :
+ * Record a call of an Into variant and pass its result through. A result
+ * above dstCap only asks the caller to retry with a larger buffer, and is
+ * left to the retry to count.
+ */
+static GoInt stats_into(GoOpStats* op, GoUint64 start, GoString src, GoInt dstCap, GoInt n)
+{
+    if (n <= dstCap)
+    {
+        stats_record(op, start, src.n, n);
+    }
+
+    return n;
+}
+
+/*! probe_log2() :
+ * log2(x) in 1/256 bits, interpolated linearly between powers of two.
+ */
+static GoUint64 probe_log2(GoUint64 x)
+{
+    unsigned const hb = 63 - __builtin_clzll(x);
+
+    return ((GoUint64)hb << 8) + ((x << 8) >> hb) - 256;
+}
+
+/*! probe_gain() :
+ * Estimate the gain of compressing src in per-mille of its size, from the
+ * order-0 entropy of probeSlices slices spread over it (or of all of it when
+ * it is small). Repetitions are not seen, so the estimate is low for data
+ * which is only compressible by matching.
+ */
+static GoInt probe_gain(const void* src, size_t srcSize)
+{
+    unsigned total[256] = {0};
+    unsigned count[256];
+    size_t sampled = 0;
+
+    int const slices = srcSize > (size_t)probeSlices * probeSliceSize ? probeSlices : 1;
+    size_t const slice = slices > 1 ? probeSliceSize : srcSize;
+
+    int i;
+    for (i = 0; i < slices; i++)
+    {
+        size_t const offset = slices > 1 ? (srcSize - slice) / (slices - 1) * i : 0;
+        unsigned maxSymbolValue = 255;
+        if (HIST_isError(HIST_count(count, &maxSymbolValue, (const char*)src + offset, slice)))
+        {
+            return 1000;
+        }
+
+        unsigned s;
+        for (s = 0; s <= maxSymbolValue; s++)
+        {
+            total[s] += count[s];
+        }
+        sampled += slice;
+    }
+
+    if (sampled == 0)
+    {
+        return 1000;
+    }
+
+    GoUint64 bits = 0;
+    GoUint64 const logSampled = probe_log2(sampled);
+
+    unsigned s;
+    for (s = 0; s < 256; s++)
+    {
+        if (total[s] > 0)
+        {
+            bits += total[s] * (logSampled - probe_log2(total[s]));
+        }
+    }
+
+    GoInt const gain = 1000 - (GoInt)(bits * 1000 / (2048 * (GoUint64)sampled));
+
+    return gain < 0 ? 0 : gain;
+}
+
+/*! probe_skip() :
+ * Tell whether the probe is on and finds src not worth compressing.
+ */
+static int probe_skip(GoString src)
+{
+    GoInt const minGain = __atomic_load_n(&probeMinGain, __ATOMIC_RELAXED);
+    if (minGain <= 0 || src.n <= 0 || probe_gain(src.p, (size_t)src.n) >= minGain)
+    {
+        return 0;
+    }
+
+    threadStats.skipped++;
+
+    return 1;
+}
+
+static GoCompressResult stats_compress(GoUint64 start, GoString src, GoCompressResult result)
+{
+    stats_record(&threadStats.compress, start, src.n, result.size);
+
+    return result;
+}
+
+static GoDecompressResult stats_decompress(GoUint64 start, GoString src, GoDecompressResult result)
+{
+    stats_record(&threadStats.decompress, start, src.n, result.size);
+
+    return result;
+}
+
+/*! cache_unlink() :
+ * Detach an entry from the LRU list and its bucket chain of the cache.
+ */
+static void cache_unlink(GoCacheEntry* entry)
+{
+    ThreadCompressCache* const cache = &threadCompressCache;
+
+    if (entry->prev != NULL) entry->prev->next = entry->next; else cache->head = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev; else cache->tail = entry->prev;
+
+    GoCacheEntry** link = &cache->buckets[entry->hash & (cache->cap - 1)];
+    while (*link != entry)
+    {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+
+    cache->stats.entries--;
+    cache->stats.bytes -= (GoInt)(entry->size + sizeof(GoCacheEntry));
+}
+
+/*! cache_get() :
+ * Look up the compressed output of src, computing its key into *hash.
+ *
+ * @return 1 and a copy of the cached output in *result on a hit, 0 otherwise.
+ */
+static int cache_get(GoString src, int level, GoUint64 generation, GoUint64* hash, GoCompressResult* result)
+{
+    ThreadCompressCache* const cache = &threadCompressCache;
+
+    *hash = XXH64(src.p, (size_t)src.n, (generation << 32) ^ (generation >> 32) ^ (GoUint64)(unsigned)level);
+
+    GoCacheEntry* entry;
+    for (entry = cache->buckets[*hash & (cache->cap - 1)]; entry != NULL; entry = entry->chain)
+    {
+        if (entry->hash == *hash && entry->rSize == (size_t)src.n && entry->generation == generation && entry->level == level)
+        {
+            break;
+        }
+    }
+    if (entry == NULL)
+    {
+        cache->stats.misses++;
+
+        return 0;
+    }
+    cache->stats.hits++;
+
+    /* Move to the front of the LRU list */
+    if (entry != cache->head)
+    {
+        entry->prev->next = entry->next;
+        if (entry->next != NULL) entry->next->prev = entry->prev; else cache->tail = entry->prev;
+
+        entry->prev = NULL;
+        entry->next = cache->head;
+        cache->head->prev = entry;
+        cache->head = entry;
+    }
+
+    result->data = malloc_orDie(entry->size);
+    result->size = (GoInt)entry->size;
+    memcpy(result->data, entry->data, entry->size);
+
+    return 1;
+}
+
+/*! cache_put() :
+ * Store a copy of a compressed output, evicting the least recently used
+ * entries to stay within budget. Outputs larger than 1/16th of the budget
+ * are not cached so that one body cannot flush the whole cache.
+ */
+static void cache_put(GoUint64 hash, size_t rSize, int level, GoUint64 generation, const void* data, size_t size)
+{
+    ThreadCompressCache* const cache = &threadCompressCache;
+    size_t const cost = size + sizeof(GoCacheEntry);
+
+    if (cost > cache->budget / 16)
+    {
+        return;
+    }
+
+    while (cache->tail != NULL && (size_t)cache->stats.bytes + cost > cache->budget)
+    {
+        GoCacheEntry* const evicted = cache->tail;
+        cache_unlink(evicted);
+        free(evicted);
+
+        cache->stats.evictions++;
+    }
+
+    if ((size_t)cache->stats.entries >= cache->cap)
+    {
+        size_t const cap = cache->cap * 2;
+        GoCacheEntry** const buckets = calloc(cap, sizeof(GoCacheEntry*));
+        if (buckets == NULL)
+        {
+            return;
+        }
+
+        GoCacheEntry* entry;
+        for (entry = cache->head; entry != NULL; entry = entry->next)
+        {
+            entry->chain = buckets[entry->hash & (cap - 1)];
+            buckets[entry->hash & (cap - 1)] = entry;
+        }
+
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->cap = cap;
+    }
+
+    /* The output is stored right after its entry, in the same allocation */
+    GoCacheEntry* const entry = malloc_orDie(cost);
+    entry->hash = hash;
+    entry->rSize = rSize;
+    entry->generation = generation;
+    entry->level = level;
+    entry->data = entry + 1;
+    entry->size = size;
+    memcpy(entry->data, data, size);
+
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL) cache->head->prev = entry; else cache->tail = entry;
+    cache->head = entry;
+
+    entry->chain = cache->buckets[hash & (cache->cap - 1)];
+    cache->buckets[hash & (cache->cap - 1)] = entry;
+
+    cache->stats.entries++;
+    cache->stats.bytes += (GoInt)cost;
+}
+
+/*! cache_drop() :
+ * Free the outputs this thread cached for a dictionary generation.
+ */
+static void cache_drop(GoUint64 generation)
+{
+    ThreadCompressCache* const cache = &threadCompressCache;
+
+    GoCacheEntry* entry = cache->head;
+    while (entry != NULL)
+    {
+        GoCacheEntry* const next = entry->next;
+        if (entry->generation == generation)
+        {
+            cache_unlink(entry);
+            free(entry);
+        }
+        entry = next;
+    }
+}
+
+/*! reserve_arena() :
+ * Make room for at least need more bytes in a batch arena, growing it
+ * geometrically. The arena is left untouched when the new capacity would not
+ * fit a GoInt or cannot be allocated.
+ *
+ * @return The first free byte of the arena, or NULL on failure.
+ */
+static void* reserve_arena(GoBatchArena* arena, size_t need)
+{
+    size_t const capMax = (size_t)-1 >> 1;
+    size_t const size = (size_t)arena->size;
+
+    if ((size_t)arena->cap - size < need)
+    {
+        if (CHECK(need <= capMax - size, "batch arena overflow") != 0)
+        {
+            return NULL;
+        }
+
+        size_t const want = size + need;
+        size_t cap = arena->cap > 0 ? (size_t)arena->cap : ZSTD_BLOCKSIZE_MAX;
+        while (cap < want)
+        {
+            cap = cap > capMax / 2 ? want : cap * 2;
+        }
+
+        void* const data = realloc(arena->data, cap);
+        if (CHECK(data != NULL, "batch arena allocation of %zu bytes", cap) != 0)
+        {
+            return NULL;
+        }
+        arena->data = data;
+        arena->cap = (GoInt)cap;
+    }
+    return (char*)arena->data + arena->size;
+}
+
+/*! stream_decompress_arena() :
+ * Stream one frame into the free space of an arena with a context set up by
+ * the caller, reserving no more than stream_decompress_hint() up front and
+ * doubling as output is produced. The arena size is left to the caller.
+ *
+ * @return The decompressed size, or a zstd error code.
+ */
+static size_t stream_decompress_arena(ZSTD_DCtx* dctx, GoBatchArena* arena, const void* src, size_t srcSize)
+{
+    size_t const reset = ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    if (ZSTD_isError(reset))
+    {
+        return reset;
+    }
+
+    size_t rCap = stream_decompress_hint(src, srcSize);
+    ZSTD_inBuffer input = { src, srcSize, 0 };
+    ZSTD_outBuffer output = { reserve_arena(arena, rCap), rCap, 0 };
+    if (output.dst == NULL)
+    {
+        return (size_t)-ZSTD_error_memory_allocation;
+    }
+
+    while (input.pos < input.size)
+    {
+        if (output.pos == output.size)
+        {
+            rCap = output.size * 2;
+            output.dst = reserve_arena(arena, rCap);
+            output.size = rCap;
+            if (output.dst == NULL)
+            {
+                ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+                return (size_t)-ZSTD_error_memory_allocation;
+            }
+        }
+
+        size_t const ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(ret))
+        {
+            ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+            return ret;
+        }
+    }
+
+    return output.pos;
+}
+
+/*! acquire_cctx() :
+ * Take a compression context from the per-thread pool, creating one when the
+ * pool is empty. Contexts are reset when given back, so a pooled context is
+ * always in its initial state.
+ *
+ * @return A ZSTD_CCtx which must be given back with release_cctx(), or NULL
+ * if allocation failed.
+ */
+static ZSTD_CCtx* acquire_cctx()
+{
+    if (threadCtxPool.cctxLen > 0)
+    {
+        threadCtxPool.stats.cctxHits++;
+
+        return threadCtxPool.cctxs[--threadCtxPool.cctxLen];
+    }
+
+    threadCtxPool.stats.cctxMisses++;
+
+    ZSTD_CCtx* const cctx = ZSTD_createCCtx();
+    CHECK(cctx != NULL, "ZSTD_createCCtx() failed!");
+
+    return cctx;
+}
+
+/*! release_cctx() :
+ * Reset a compression context and give it back to the per-thread pool. The
+ * context is freed instead when the pool is already full.
+ */
+static void release_cctx(ZSTD_CCtx* cctx)
+{
+    if (cctx == NULL)
+    {
+        return;
+    }
+
+    if (threadCtxPool.cctxLen >= ctxPoolLen || ZSTD_isError(ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters)))
+    {
+        ZSTD_freeCCtx(cctx);
+
+        return;
+    }
+
+    threadCtxPool.cctxs[threadCtxPool.cctxLen++] = cctx;
+}
+
+/*! record_dict_stats() :
+ * Account one compression with a dictionary. The thread whose input closes
+ * a window publishes its ratio as the rolling one, the first window also
+ * sets the baseline. One call in dictProbeEvery is compressed again without
+ * the dictionary to measure what the dictionary is gaining, with cctx if the
+ * caller still holds one or else with a pooled context.
+ */
+static void record_dict_stats(GoDict* entry, ZSTD_CCtx* cctx, const void* src, size_t rSize, size_t cSize)
+{
+    GoDictCounters* const counters = &entry->counters;
+
+    GoUint64 const calls = __atomic_add_fetch(&counters->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters->bytesIn, rSize, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters->bytesOut, cSize, __ATOMIC_RELAXED);
+
+    GoUint64 const windowOut = __atomic_add_fetch(&counters->windowOut, cSize, __ATOMIC_RELAXED);
+    GoUint64 const windowIn = __atomic_add_fetch(&counters->windowIn, rSize, __ATOMIC_RELAXED);
+    if (windowIn >= dictStatsWindow && windowIn - rSize < dictStatsWindow)
+    {
+        GoUint64 const ratio = windowOut > 0 ? windowIn * 1000 / windowOut : 0;
+
+        __atomic_store_n(&counters->rolling, ratio, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&counters->baseline, __ATOMIC_RELAXED) == 0)
+        {
+            __atomic_store_n(&counters->baseline, ratio, __ATOMIC_RELAXED);
+        }
+
+        __atomic_sub_fetch(&counters->windowOut, windowOut, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&counters->windowIn, windowIn, __ATOMIC_RELAXED);
+    }
+
+    if (calls % dictProbeEvery == 1 && rSize > 0)
+    {
+        ZSTD_CCtx* const pctx = cctx != NULL ? cctx : acquire_cctx();
+        if (pctx == NULL)
+        {
+            return;
+        }
+
+        size_t const cBuffSize = ZSTD_compressBound(rSize);
+        void* const cBuff = malloc_orDie(cBuffSize);
+
+        size_t const pSize = ZSTD_compressCCtx(pctx, cBuff, cBuffSize, src, rSize, entry->level);
+        if (pctx != cctx)
+        {
+            release_cctx(pctx);
+        }
+        free(cBuff);
+
+        if (!ZSTD_isError(pSize))
+        {
+            __atomic_add_fetch(&counters->probeIn, rSize, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&counters->probeOut, pSize, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*! acquire_dctx() :
+ * Take a decompression context from the per-thread pool, creating one when
+ * the pool is empty.
+ *
+ * @return A ZSTD_DCtx which must be given back with release_dctx(), or NULL
+ * if allocation failed.
+ */
+static ZSTD_DCtx* acquire_dctx()
+{
+    if (threadCtxPool.dctxLen > 0)
+    {
+        threadCtxPool.stats.dctxHits++;
+
+        return threadCtxPool.dctxs[--threadCtxPool.dctxLen];
+    }
+
+    threadCtxPool.stats.dctxMisses++;
+
+    ZSTD_DCtx* const dctx = ZSTD_createDCtx();
+    CHECK(dctx != NULL, "ZSTD_createDCtx() failed!");
+
+    return dctx;
+}
+
+/*! release_dctx() :
+ * Reset a decompression context, which also drops any referenced DDict, and
+ * give it back to the per-thread pool. The context is freed instead when the
+ * pool is already full.
+ */
+static void release_dctx(ZSTD_DCtx* dctx)
+{
+    if (dctx == NULL)
+    {
+        return;
+    }
+
+    if (threadCtxPool.dctxLen >= ctxPoolLen || ZSTD_isError(ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters)))
+    {
+        ZSTD_freeDCtx(dctx);
+
+        return;
+    }
+
+    threadCtxPool.dctxs[threadCtxPool.dctxLen++] = dctx;
+}
+
+/*! stream_decompress() :
+ * Decompress gs with streaming, which needs no content size in the frame
+ * header, using ddict when it is not NULL. The caller keeps whatever owns
+ * ddict alive for the duration of the call.
+ */
+static GoDecompressResult stream_decompress(GoString gs, ZSTD_DDict* ddict)
+{
+    GoDecompressResult result = { NULL, -1 };
+
+    ZSTD_DCtx* const dctx = acquire_dctx();
+    if (dctx == NULL)
+    {
+        return result;
+    }
+
+    if (ddict != NULL)
+    {
+        size_t const dret = ZSTD_DCtx_refDDict(dctx, ddict);
+        if (CHECK_ZSTD(dret, "cannot init dict for stream decompress") != 0)
+        {
+            release_dctx(dctx);
+
+            return result;
+        }
+    }
+
+    size_t cSize = (size_t)gs.n;
+    void* const cBuff = (void* const)gs.p;
+
+    /* Decompress straight into the result, growing it geometrically, so the
+     * bytes already produced are copied at most O(log N) times.
+     */
+    size_t rCap = stream_decompress_hint(cBuff, cSize);
+    void* rBuff = malloc_orDie(rCap);
+
+    /* Given a valid frame, zstd won't consume the last byte of the frame
+    * until it has flushed all of the decompressed data of the frame.
+    * Therefore, instead of checking if the return code is 0, we can
+    * decompress just check if input.pos < input.size.
+    */
+    ZSTD_inBuffer input = { cBuff, cSize, 0 };
+    ZSTD_outBuffer output = { rBuff, rCap, 0 };
+
+    while (input.pos < input.size) {
+        if (output.pos == output.size)
+        {
+            rCap = output.size * 2;
+            rBuff = realloc_orDie(rBuff, rCap);
+
+            if (isDebug == 1)
+            {
+                LOGF("[DEBUG] zstd stream dict decompress: grow size=%zu, cap=%zu", output.pos, rCap);
+            }
+            output.dst = rBuff;
+            output.size = rCap;
+        }
+
+        /* The return code is zero if the frame is complete, but there may
+        * be multiple frames concatenated together. Zstd will automatically
+        * reset the context when a frame is complete. Still, calling
+        * ZSTD_DCtx_reset() can be useful to reset the context to a clean
+        * state, for instance if the last decompression call returned an
+        * error.
+        */
+        size_t const ret = ZSTD_decompressStream(dctx, &output , &input);
+        if (CHECK_ZSTD(ret, "invalid frame of zstd") != 0)
+        {
+            free(rBuff);
+            release_dctx(dctx);
+
+            return result;
+        }
+    }
+
+    result.data = rBuff;
+    result.size = output.pos;
+
+    release_dctx(dctx);
+
+    return result;
 }
 
 #ifdef __cplusplus
@@ -1,89 +1,80 @@
 -- Base64-encoding
--- Sourced from http://en.wikipedia.org/wiki/Base64
+-- FFI binding for the base64.c codec exported by the zstd shared library.
+-- Results are written into a reusable buffer (Base64EncodeInto/
+-- Base64DecodeInto), so no C allocation has to be freed from Lua.
 
-local __author__ = 'Daniel Lindsley'
-local __version__ = 'scm-1'
-local __license__ = 'BSD'
+local ffi = require("ffi")
 
-local index_table = 'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/'
-
-function to_binary(integer)
-    local remaining = tonumber(integer)
-    local bin_bits = ''
-
-    for i = 7, 0, -1 do
-        local current_power = 2 ^ i
+local lib
+if jit.os == 'OSX' then
+    lib = ffi.load("lib/libzstd_darwin_amd64.so")
+elseif jit.os == 'Linux' then
+    lib = ffi.load("lib/libzstd_linux_amd64.so")
+end
 
-        if remaining >= current_power then
-            bin_bits = bin_bits .. '1'
-            remaining = remaining - current_power
-        else
-            bin_bits = bin_bits .. '0'
-        end
+-- Own struct name so that this module can be loaded next to the full zstd cdefs
+ffi.cdef([[
+typedef struct { const char *p; ptrdiff_t n; } Base64String;
+
+extern long long Base64EncodeInto(Base64String src, void* dst, long long dstCap, long long flags);
+extern long long Base64DecodeInto(Base64String src, void* dst, long long dstCap);
+]])
+
+local BASE64_URL_SAFE = 1
+local BASE64_NO_WRAP = 2
+
+local stringType = ffi.typeof("Base64String")
+local bufCap = 4096
+local buf = ffi.new("char[?]", bufCap)
+
+-- Calls fn with the scratch buffer, growing it to the size asked for by the
+-- library until the result fits.
+local function into(fn, input, ...)
+    local src = stringType(input, #input)
+    local n = tonumber(fn(src, buf, bufCap, ...))
+    if n > bufCap then
+        bufCap = n
+        buf = ffi.new("char[?]", bufCap)
+        n = tonumber(fn(src, buf, bufCap, ...))
     end
 
-    return bin_bits
-end
-
-function from_binary(bin_bits)
-    return tonumber(bin_bits, 2)
+    return n
 end
 
-
-function to_base64(to_encode)
-    local bit_pattern = ''
-    local encoded = ''
-    local trailing = ''
-
-    for i = 1, string.len(to_encode) do
-        bit_pattern = bit_pattern .. to_binary(string.byte(string.sub(to_encode, i, i)))
+local function encode(to_encode, flags)
+    local n = into(lib.Base64EncodeInto, to_encode, flags or 0)
+    if n < 0 then
+        error("base64 encode failed")
     end
 
-    -- Check the number of bytes. If it's not evenly divisible by three,
-    -- zero-pad the ending & append on the correct number of ``=``s.
-    if string.len(bit_pattern) % 3 == 2 then
-        trailing = '=='
-        bit_pattern = bit_pattern .. '0000000000000000'
-    elseif string.len(bit_pattern) % 3 == 1 then
-        trailing = '='
-        bit_pattern = bit_pattern .. '00000000'
+    return ffi.string(buf, n)
+end
+
+local function decode(to_decode)
+    if #to_decode == 0 then
+        return ""
     end
 
-    for i = 1, string.len(bit_pattern), 6 do
-        local byte = string.sub(bit_pattern, i, i+5)
-        local offset = tonumber(from_binary(byte))
-        encoded = encoded .. string.sub(index_table, offset+1, offset+1)
+    local n = into(lib.Base64DecodeInto, to_decode)
+    if n < 0 then
+        error("Invalid base64 data")
     end
 
-    return string.sub(encoded, 1, -1 - string.len(trailing)) .. trailing
+    return ffi.string(buf, n)
 end
 
+-- Single line with padding, like the previous pure Lua implementation
+function to_base64(to_encode)
+    return encode(to_encode, BASE64_NO_WRAP)
+end
 
 function from_base64(to_decode)
-    local padded = to_decode:gsub("%s", "")
-    local unpadded = padded:gsub("=", "")
-    local bit_pattern = ''
-    local decoded = ''
-
-    for i = 1, string.len(unpadded) do
-        local char = string.sub(to_decode, i, i)
-        local offset, _ = string.find(index_table, char)
-        if offset == nil then
-            error("Invalid character '" .. char .. "' found.")
-        end
-
-        bit_pattern = bit_pattern .. string.sub(to_binary(offset-1), 3)
-    end
-
-    for i = 1, string.len(bit_pattern), 8 do
-        local byte = string.sub(bit_pattern, i, i+7)
-        decoded = decoded .. string.char(from_binary(byte))
-    end
-
-    local padding_length = padded:len()-unpadded:len()
+    return decode(to_decode)
+end
 
-    if (padding_length == 1 or padding_length == 2) then
-        decoded = decoded:sub(1,-2)
-    end
-    return decoded
-end
\ No newline at end of file
+return {
+    URL_SAFE = BASE64_URL_SAFE,
+    NO_WRAP = BASE64_NO_WRAP,
+    encode = encode,
+    decode = decode,
+}
@@ -39,18 +39,77 @@ typedef struct { void *data; GoInt len; GoInt cap; } GoSlice;
 /* Return type for Compress */
 typedef struct GoCompressResult { void* data; GoInt size; } GoCompressResult;
 typedef struct GoDecompressResult { void *data; GoInt size; } GoDecompressResult;
+typedef struct GoCompressParams { GoInt level; GoInt windowLog; GoInt strategy; GoInt checksumFlag; GoInt noContentSize; GoInt nbWorkers; GoInt jobSize; GoInt maxRatio; } GoCompressParams;
+typedef struct GoTrainParams { GoInt level; GoInt k; GoInt d; GoInt steps; GoInt optimize; } GoTrainParams;
+typedef struct GoDictStats { GoUint64 calls; GoUint64 bytesIn; GoUint64 bytesOut; GoFloat64 ratio; GoFloat64 rollingRatio; GoFloat64 baselineRatio; GoFloat64 noDictRatio; GoInt drifted; } GoDictStats;
+typedef struct GoBatchArena { void* data; GoInt cap; GoInt size; } GoBatchArena;
+typedef struct GoCompressCacheStats { GoUint64 hits; GoUint64 misses; GoUint64 evictions; GoInt entries; GoInt bytes; } GoCompressCacheStats;
+typedef struct GoOpStats { GoUint64 calls; GoUint64 errors; GoUint64 bytesIn; GoUint64 bytesOut; GoUint64 latencyNs; GoUint64 latency[8][8]; } __attribute__((aligned(64))) GoOpStats;
+typedef struct GoStats { GoOpStats compress; GoOpStats decompress; GoUint64 cctxAllocs; GoUint64 dctxAllocs; GoUint64 streamFallbacks; GoUint64 skipped; } __attribute__((aligned(64))) GoStats;
+typedef struct GoCtxPoolStats { GoUint64 cctxHits; GoUint64 cctxMisses; GoUint64 dctxHits; GoUint64 dctxMisses; } GoCtxPoolStats;
 
 /* for c free */
 void free(void *ptr);
+int fork(void);
+int waitpid(int pid, int *status, int options);
+void _exit(int status);
+int usleep(unsigned int usec);
 
 extern void EnableDebug();
 extern void DisableDebug();
 extern void AddDict(GoString name, GoString filename);
+extern void AddDictWithLevel(GoString name, GoString filename, GoInt level);
+extern GoInt AddDictFromMemory(GoString name, void* dict, GoInt dictSize, GoInt isBase64);
+extern GoInt ReplaceDict(GoString name, GoString filename);
+extern GoInt AddSharedDict(GoString name, GoString filename, GoInt level);
+extern GoInt FreezeSharedDicts();
+extern GoInt RemoveDict(GoString name);
+extern GoInt GetDictStats(GoString name, GoDictStats* stats);
 extern void ReleaseDict();
+extern GoInt TrainDict(GoString name, void* samples, size_t* sampleSizes, GoInt n, GoInt dictCapacity, GoTrainParams params);
+extern GoInt InstallTrainedDicts();
+extern GoInt WaitTrainDicts();
+extern void EnableSampling(GoInt maxSamples, GoInt maxSampleSize, GoInt memoryCap);
+extern void DisableSampling();
+extern GoInt GetSamples(GoString key, GoBatchArena* arena, size_t* sampleSizes, GoInt maxN);
+extern GoInt WriteSamples(GoString key, GoString dir);
+extern GoInt AddParams(GoString name, GoCompressParams params);
+extern void ReleaseParams();
+extern void EnableCompressCache(GoInt budget);
+extern void DisableCompressCache();
+extern struct GoCompressCacheStats GetCompressCacheStats();
+extern void SetSmallMode(GoInt passThrough, GoInt magicless);
+extern struct GoCompressResult CompressSmall(GoString src, GoString dict);
+extern struct GoDecompressResult DecompressSmall(GoString src, GoString dict);
+extern void EnableCompressProbe(GoInt minGain);
+extern void DisableCompressProbe();
+extern GoInt ProbeCompressible(GoString src);
+extern void GetStats(GoStats* stats);
+extern struct GoCtxPoolStats GetCtxPoolStats();
+extern void ReleaseCtxPool();
 extern struct GoCompressResult Compress(GoString src);
 extern struct GoDecompressResult Decompress(GoString dst);
+extern GoInt CompressBatch(GoString* srcs, GoInt n, GoString dict, GoBatchArena* arena, GoInt* offsets);
+extern GoInt DecompressBatch(GoString* srcs, GoInt n, GoString dict, GoBatchArena* arena, GoInt* offsets);
+extern void ReleaseBatchArena(GoBatchArena* arena);
+extern GoInt CompressInto(GoString src, void* dst, GoInt dstCap);
+extern GoInt DecompressInto(GoString src, void* dst, GoInt dstCap);
 extern struct GoCompressResult CompressWithDict(GoString src, GoString dict);
+extern struct GoCompressResult CompressToBase64(GoString src, GoString dict, GoInt flags);
+extern struct GoDecompressResult DecompressFromBase64(GoString src, GoString dict);
 extern struct GoDecompressResult DecompressWithDict(GoString dst, GoString dict);
+extern struct GoDecompressResult DecompressAuto(GoString dst);
+extern struct GoCompressResult CompressSeekable(GoString src, GoInt frameSize);
+extern struct GoDecompressResult DecompressRange(GoString src, GoInt offset, GoInt length);
+extern struct GoCompressResult CompressMT(GoString src, GoString params);
+extern struct GoCompressResult CompressWithParams(GoString src, GoString params);
+extern struct GoCompressResult CompressWithDictAndParams(GoString src, GoString dict, GoString params);
+extern void* CompressStreamBegin(GoInt level, GoString dict);
+extern struct GoCompressResult CompressStreamFeed(void* stream, GoString chunk, GoInt flushMode);
+extern void CompressStreamEnd(void* stream);
+extern void* DecompressStreamBegin(GoString dict, GoInt maxOutput);
+extern struct GoDecompressResult DecompressStreamFeed(void* stream, GoString chunk);
+extern void DecompressStreamEnd(void* stream);
 
 ]])
 
@@ -116,6 +175,12 @@ io.write(string.format("Decompressed with dict output => %s\n", ffi.string(dictD
 assert(ffi.string(dictDecompressResult.data, dictDecompressResult.size) == dictActual)
 ffi.C.free(dictDecompressResult.data)
 
+-- decompress with dict selected by frame dictID
+local autoOutput = zstd.DecompressAuto(goStringType(dictDecompressData, #dictDecompressData))
+io.write(string.format("Decompressed with auto dict output => %s\n", ffi.string(autoOutput.data, autoOutput.size)))
+assert(ffi.string(autoOutput.data, autoOutput.size) == dictActual)
+ffi.C.free(autoOutput.data)
+
 -- for ngx
 io.write("\n-- for ngx\n")
 local ngData = from_base64("KLUv/SA+8QEASGVsbG8sIHdvcmxkISBUaGlzIGlzIGEgZ29sYW5nIHpzdGQgYmluZGluZyBmb3IgYyB3aXRoIGx1YWppdC4=")
@@ -162,4 +227,490 @@ local file2Output = zstd.Decompress(file2Input)
 local file2Result = ffi.new("struct GoDecompressResult", file2Output)
 io.write(string.format("Decompressed without dict output => lua type=%s, ffi type=%s, size=%d\n", type(file2Result.data), ffi.typeof(file2Result.data), tonumber(file2Result.size)))
 io.write(string.format("Decompressed without dict output => %s\n", ffi.string(file2Result.data, file2Result.size)))
-ffi.C.free(file2Result.data)
\ No newline at end of file
+ffi.C.free(file2Result.data)
+
+-- compress with named params
+io.write("\n-- compress with named params\n")
+local paramsName = "fast"
+local paramsKey = goStringType(paramsName, #paramsName)
+assert(zstd.AddParams(paramsKey, ffi.new("GoCompressParams", { level = -5, checksumFlag = 1 })) == 0)
+
+local paramsOutput = zstd.CompressWithDictAndParams(goStringType(dictActual, #dictActual), dictName, paramsKey)
+local paramsData = ffi.string(paramsOutput.data, paramsOutput.size)
+ffi.C.free(paramsOutput.data)
+
+local paramsDecompressOutput = zstd.DecompressWithDict(goStringType(paramsData, #paramsData), dictName)
+assert(ffi.string(paramsDecompressOutput.data, paramsDecompressOutput.size) == dictActual)
+ffi.C.free(paramsDecompressOutput.data)
+
+-- params left at 0 keep the content size in the frame, so DecompressInto
+-- can report the exact size needed; noContentSize drops it
+local sizeCap = 8
+local sizeBuff = ffi.new("uint8_t[?]", sizeCap)
+assert(tonumber(zstd.DecompressInto(goStringType(paramsData, #paramsData), sizeBuff, sizeCap)) == #dictActual)
+local noSizeKey = goStringType("no-size", #"no-size")
+assert(zstd.AddParams(noSizeKey, ffi.new("GoCompressParams", { level = 3, noContentSize = 1 })) == 0)
+local noSizeOutput = zstd.CompressWithParams(goStringType(dictActual, #dictActual), noSizeKey)
+local noSizeData = ffi.string(noSizeOutput.data, noSizeOutput.size)
+ffi.C.free(noSizeOutput.data)
+assert(tonumber(zstd.DecompressInto(goStringType(noSizeData, #noSizeData), sizeBuff, sizeCap)) ~= #dictActual)
+
+-- the params registry grows as needed, with no fixed limit
+for i = 1, 40 do
+    local manyName = "many-" .. i
+    assert(zstd.AddParams(goStringType(manyName, #manyName), ffi.new("GoCompressParams", { level = i % 19 + 1 })) == 0)
+end
+assert(zstd.AddParams(goStringType("many-7", #"many-7"), ffi.new("GoCompressParams", { level = 3 })) == -1)
+local manyOutput = zstd.CompressWithParams(goStringType(dictActual, #dictActual), goStringType("many-40", #"many-40"))
+local manyDecompressOutput = zstd.Decompress(goStringType(manyOutput.data, manyOutput.size))
+assert(ffi.string(manyDecompressOutput.data, manyDecompressOutput.size) == dictActual)
+ffi.C.free(manyOutput.data)
+ffi.C.free(manyDecompressOutput.data)
+
+-- compress mt: default params use the shared context, which bypasses the
+-- ctx pool, while params without workers take a pooled context, as a call
+-- finding the shared context busy does
+io.write("\n-- compress mt\n")
+local mtActual = string.rep(dictActual, 4096)
+local mtInput = goStringType(mtActual, #mtActual)
+for _, mtParams in ipairs({ goStringType("", 0), paramsKey }) do
+    local poolHits = tonumber(zstd.GetCtxPoolStats().cctxHits)
+    local mtOutput = zstd.CompressMT(mtInput, mtParams)
+    assert(tonumber(mtOutput.size) > 0)
+    assert(tonumber(zstd.GetCtxPoolStats().cctxHits) == poolHits + (mtParams.n > 0 and 1 or 0))
+    local mtDecompressOutput = zstd.Decompress(goStringType(mtOutput.data, mtOutput.size))
+    assert(ffi.string(mtDecompressOutput.data, mtDecompressOutput.size) == mtActual)
+    ffi.C.free(mtOutput.data)
+    ffi.C.free(mtDecompressOutput.data)
+end
+
+-- the short input does not compress to half its size, so compression gives up
+local boundedName = "bounded"
+local boundedKey = goStringType(boundedName, #boundedName)
+assert(zstd.AddParams(boundedKey, ffi.new("GoCompressParams", { level = 3, maxRatio = 500 })) == 0)
+local boundedOutput = zstd.CompressWithParams(goStringType(actual, #actual), boundedKey)
+io.write(string.format("compress with maxRatio=500 => size=%d\n", tonumber(boundedOutput.size)))
+assert(tonumber(boundedOutput.size) == 0)
+zstd.ReleaseParams()
+
+-- compress/decompress into caller buffer
+io.write("\n-- compress/decompress into caller buffer\n")
+local scratchCap = 4096
+local scratch = ffi.new("uint8_t[?]", scratchCap)
+
+local intoSize = tonumber(zstd.CompressInto(goStringType(actual, #actual), scratch, scratchCap))
+assert(intoSize > 0 and intoSize <= scratchCap)
+local intoData = ffi.string(scratch, intoSize)
+
+local intoDecompressSize = tonumber(zstd.DecompressInto(goStringType(intoData, #intoData), scratch, scratchCap))
+io.write(string.format("Decompressed into buffer => %s\n", ffi.string(scratch, intoDecompressSize)))
+assert(ffi.string(scratch, intoDecompressSize) == actual)
+
+local tinyCap = 8
+local tiny = ffi.new("uint8_t[?]", tinyCap)
+assert(tonumber(zstd.DecompressInto(goStringType(intoData, #intoData), tiny, tinyCap)) == #actual)
+
+-- a negative capacity is rejected rather than taken as a huge one
+assert(tonumber(zstd.CompressInto(goStringType(actual, #actual), tiny, -1)) == -1)
+assert(tonumber(zstd.DecompressInto(goStringType(intoData, #intoData), tiny, -1)) == -1)
+
+-- stream compress by chunks
+io.write("\n-- stream compress by chunks\n")
+local stream = zstd.CompressStreamBegin(3, dictName)
+assert(stream ~= nil)
+
+local chunks = {}
+for i = 1, 3 do
+    local streamOutput = zstd.CompressStreamFeed(stream, goStringType(dictActual, #dictActual), i == 3 and 2 or 1)
+    assert(tonumber(streamOutput.size) >= 0)
+    chunks[#chunks+1] = ffi.string(streamOutput.data, streamOutput.size)
+end
+zstd.CompressStreamEnd(stream)
+
+local streamData = table.concat(chunks)
+local streamDecompressOutput = zstd.DecompressWithDict(goStringType(streamData, #streamData), dictName)
+assert(ffi.string(streamDecompressOutput.data, streamDecompressOutput.size) == dictActual .. dictActual .. dictActual)
+ffi.C.free(streamDecompressOutput.data)
+
+-- stream frames carry no content size, so DecompressAuto streams them with the dict of the frame
+local streamAutoOutput = zstd.DecompressAuto(goStringType(streamData, #streamData))
+assert(ffi.string(streamAutoOutput.data, streamAutoOutput.size) == dictActual .. dictActual .. dictActual)
+ffi.C.free(streamAutoOutput.data)
+
+-- stream decompress by chunks
+io.write("\n-- stream decompress by chunks\n")
+local dstream = zstd.DecompressStreamBegin(dictName, 0)
+assert(dstream ~= nil)
+
+local dchunks = {}
+for i = 1, #streamData, 16 do
+    local chunk = string.sub(streamData, i, i + 15)
+    local dstreamOutput = zstd.DecompressStreamFeed(dstream, goStringType(chunk, #chunk))
+    assert(tonumber(dstreamOutput.size) >= 0)
+    dchunks[#dchunks+1] = ffi.string(dstreamOutput.data, dstreamOutput.size)
+end
+zstd.DecompressStreamEnd(dstream)
+assert(table.concat(dchunks) == dictActual .. dictActual .. dictActual)
+
+-- a chunk expanding past maxOutput fails instead of growing the buffer
+local bomb = string.rep("a", 1024 * 1024)
+local bombResult = zstd.Compress(goStringType(bomb, #bomb))
+local bombData = ffi.string(bombResult.data, bombResult.size)
+ffi.C.free(bombResult.data)
+local bombStream = zstd.DecompressStreamBegin(goStringType("", 0), 64 * 1024)
+assert(bombStream ~= nil)
+assert(tonumber(zstd.DecompressStreamFeed(bombStream, goStringType(bombData, #bombData)).size) == -1)
+zstd.DecompressStreamEnd(bombStream)
+bombStream = zstd.DecompressStreamBegin(goStringType("", 0), #bomb + 1)
+local bombOutput = zstd.DecompressStreamFeed(bombStream, goStringType(bombData, #bombData))
+assert(ffi.string(bombOutput.data, bombOutput.size) == bomb)
+zstd.DecompressStreamEnd(bombStream)
+
+-- replace/remove dict while a stream is using it
+io.write("\n-- replace/remove dict\n")
+local rstream = zstd.CompressStreamBegin(3, dictName)
+assert(zstd.ReplaceDict(dictName, dictFilename) == 0)
+local rstreamOutput = zstd.CompressStreamFeed(rstream, goStringType(dictActual, #dictActual), 2)
+local rstreamData = ffi.string(rstreamOutput.data, rstreamOutput.size)
+zstd.CompressStreamEnd(rstream)
+
+local rdecompressOutput = zstd.DecompressWithDict(goStringType(rstreamData, #rstreamData), dictName)
+assert(ffi.string(rdecompressOutput.data, rdecompressOutput.size) == dictActual)
+ffi.C.free(rdecompressOutput.data)
+
+local removeName = "removing"
+local removeKey = goStringType(removeName, #removeName)
+zstd.AddDict(removeKey, dictFilename)
+assert(zstd.RemoveDict(removeKey) == 0)
+assert(zstd.RemoveDict(removeKey) == -1)
+
+-- add dict from memory
+io.write("\n-- add dict from memory\n")
+local dictFd = io.open(filename, "rb")
+local dictContent = dictFd:read "*a"
+dictFd:close()
+
+local memoryName = "memory"
+local memoryKey = goStringType(memoryName, #memoryName)
+assert(zstd.AddDictFromMemory(memoryKey, ffi.cast("void*", dictContent), #dictContent, 1) == 0)
+
+local memoryOutput = zstd.CompressWithDict(goStringType(dictActual, #dictActual), memoryKey)
+local memoryData = ffi.string(memoryOutput.data, memoryOutput.size)
+ffi.C.free(memoryOutput.data)
+
+local memoryDecompressOutput = zstd.DecompressWithDict(goStringType(memoryData, #memoryData), memoryKey)
+assert(ffi.string(memoryDecompressOutput.data, memoryDecompressOutput.size) == dictActual)
+ffi.C.free(memoryDecompressOutput.data)
+
+-- seekable compress and range decompress
+io.write("\n-- seekable compress and range decompress\n")
+local seekableActual = string.rep(dictActual, 100)
+local seekableOutput = zstd.CompressSeekable(goStringType(seekableActual, #seekableActual), 1024)
+local seekableData = ffi.string(seekableOutput.data, seekableOutput.size)
+ffi.C.free(seekableOutput.data)
+
+local rangeOutput = zstd.DecompressRange(goStringType(seekableData, #seekableData), 1000, 100)
+io.write(string.format("Decompressed range => %s\n", ffi.string(rangeOutput.data, rangeOutput.size)))
+assert(ffi.string(rangeOutput.data, rangeOutput.size) == string.sub(seekableActual, 1001, 1100))
+ffi.C.free(rangeOutput.data)
+
+-- batch compress/decompress
+io.write("\n-- batch compress/decompress\n")
+local batchValues = { "alpha", "beta", dictActual, actual }
+local batchN = #batchValues
+local batchInput = ffi.new("GoString[?]", batchN)
+for i, v in ipairs(batchValues) do
+    batchInput[i-1] = goStringType(v, #v)
+end
+
+local batchArena = ffi.new("GoBatchArena[1]")
+local batchOffsets = ffi.new("GoInt[?]", batchN + 1)
+assert(tonumber(zstd.CompressBatch(batchInput, batchN, dictName, batchArena, batchOffsets)) == 0)
+
+local batchCompressed = ffi.new("GoString[?]", batchN)
+for i = 0, batchN - 1 do
+    batchCompressed[i].p = ffi.cast("const char*", batchArena[0].data) + batchOffsets[i]
+    batchCompressed[i].n = batchOffsets[i+1] - batchOffsets[i]
+end
+
+local unbatchArena = ffi.new("GoBatchArena[1]")
+local unbatchOffsets = ffi.new("GoInt[?]", batchN + 1)
+assert(tonumber(zstd.DecompressBatch(batchCompressed, batchN, dictName, unbatchArena, unbatchOffsets)) == 0)
+for i, v in ipairs(batchValues) do
+    local item = ffi.string(ffi.cast("const char*", unbatchArena[0].data) + unbatchOffsets[i-1], unbatchOffsets[i] - unbatchOffsets[i-1])
+    assert(item == v)
+end
+
+-- frames without a content size are streamed into the arena, a broken one
+-- only fails its own item
+local mixedInput = ffi.new("GoString[?]", 3)
+mixedInput[0] = goStringType(streamData, #streamData)
+mixedInput[1] = goStringType("not a frame", #"not a frame")
+mixedInput[2] = batchCompressed[2]
+assert(tonumber(zstd.DecompressBatch(mixedInput, 3, dictName, unbatchArena, unbatchOffsets)) == 1)
+local mixedBase = ffi.cast("const char*", unbatchArena[0].data)
+assert(ffi.string(mixedBase + unbatchOffsets[0], unbatchOffsets[1] - unbatchOffsets[0]) == dictActual .. dictActual .. dictActual)
+assert(unbatchOffsets[2] == unbatchOffsets[1])
+assert(ffi.string(mixedBase + unbatchOffsets[2], unbatchOffsets[3] - unbatchOffsets[2]) == dictActual)
+
+-- a forged content size is not trusted: the frame is streamed and fails as
+-- a single empty item
+local forged = "\x28\xb5\x2f\xfd\xc0\x00\xf0\xff\xff\xff\xff\xff\xff\xff\x01\x00\x00"
+local forgedInput = ffi.new("GoString[?]", 2)
+forgedInput[0] = goStringType(forged, #forged)
+forgedInput[1] = batchCompressed[2]
+assert(tonumber(zstd.DecompressBatch(forgedInput, 2, dictName, unbatchArena, unbatchOffsets)) == 1)
+assert(unbatchOffsets[1] == unbatchOffsets[0])
+assert(ffi.string(ffi.cast("const char*", unbatchArena[0].data) + unbatchOffsets[1], unbatchOffsets[2] - unbatchOffsets[1]) == dictActual)
+zstd.ReleaseBatchArena(batchArena)
+zstd.ReleaseBatchArena(unbatchArena)
+
+-- train dict
+io.write("\n-- train dict\n")
+local trainSamples = {}
+for i = 1, 1000 do
+    trainSamples[i] = string.format('{"user":"u%d","status":"active","plan":"%s"}', i * 13, i % 3 == 0 and "free" or "pro")
+end
+local trainBuffer = table.concat(trainSamples)
+local trainSizes = ffi.new("size_t[?]", #trainSamples)
+for i, v in ipairs(trainSamples) do
+    trainSizes[i-1] = #v
+end
+local trainName = goStringType("trained", #"trained")
+assert(tonumber(zstd.TrainDict(trainName, ffi.cast("void*", trainBuffer), trainSizes, #trainSamples, 4096, ffi.new("GoTrainParams"))) == 0)
+assert(tonumber(zstd.WaitTrainDicts()) == 1)
+local trainInput = goStringType(trainSamples[1], #trainSamples[1])
+local trained = zstd.CompressWithDict(trainInput, trainName)
+assert(tonumber(trained.size) > 0)
+local untrained = zstd.DecompressWithDict(goStringType(trained.data, trained.size), trainName)
+assert(ffi.string(untrained.data, untrained.size) == trainSamples[1])
+io.write(string.format("trained dict => compressed %d bytes to %d\n", #trainSamples[1], tonumber(trained.size)))
+ffi.C.free(trained.data)
+ffi.C.free(untrained.data)
+
+-- a finished training is registered by InstallTrainedDicts, never by a lookup
+local lateName = goStringType("trained-late", #"trained-late")
+assert(tonumber(zstd.TrainDict(lateName, ffi.cast("void*", trainBuffer), trainSizes, #trainSamples, 4096, ffi.new("GoTrainParams"))) == 0)
+local installed = 0
+for _ = 1, 10000 do
+    local late = zstd.CompressWithDict(trainInput, lateName)
+    assert(tonumber(late.size) == -1)
+    installed = tonumber(zstd.InstallTrainedDicts())
+    if installed > 0 then
+        break
+    end
+    ffi.C.usleep(1000)
+end
+assert(installed == 1)
+local late = zstd.CompressWithDict(trainInput, lateName)
+assert(tonumber(late.size) > 0)
+ffi.C.free(late.data)
+
+-- sampling
+io.write("\n-- sampling\n")
+zstd.EnableSampling(16, 1024, 64 * 1024)
+for i, v in ipairs(trainSamples) do
+    local sampled = zstd.CompressWithDict(goStringType(v, #v), trainName)
+    ffi.C.free(sampled.data)
+end
+local sampleArena = ffi.new("GoBatchArena[1]")
+local sampleSizes = ffi.new("size_t[?]", 16)
+local sampleCount = tonumber(zstd.GetSamples(trainName, sampleArena, sampleSizes, 16))
+io.write(string.format("sampled => %d samples, %d bytes\n", sampleCount, tonumber(sampleArena[0].size)))
+assert(sampleCount == 16)
+zstd.ReleaseBatchArena(sampleArena)
+zstd.DisableSampling()
+
+-- dict stats
+io.write("\n-- dict stats\n")
+local dictStats = ffi.new("GoDictStats[1]")
+assert(tonumber(zstd.GetDictStats(trainName, dictStats)) == 0)
+io.write(string.format("dict stats => calls=%d, ratio=%.2f, rolling=%.2f, drifted=%d\n", tonumber(dictStats[0].calls), dictStats[0].ratio, dictStats[0].rollingRatio, tonumber(dictStats[0].drifted)))
+assert(tonumber(dictStats[0].calls) == #trainSamples + 1)
+assert(tonumber(dictStats[0].drifted) == 0)
+
+-- compress cache
+io.write("\n-- compress cache\n")
+zstd.EnableCompressCache(1024 * 1024)
+local cached1 = zstd.Compress(compressInput)
+local cached2 = zstd.Compress(compressInput)
+assert(ffi.string(cached1.data, cached1.size) == ffi.string(cached2.data, cached2.size))
+local cacheStats = zstd.GetCompressCacheStats()
+io.write(string.format("compress cache => hits=%d, misses=%d, entries=%d, bytes=%d\n", tonumber(cacheStats.hits), tonumber(cacheStats.misses), tonumber(cacheStats.entries), tonumber(cacheStats.bytes)))
+assert(tonumber(cacheStats.hits) == 1)
+ffi.C.free(cached1.data)
+ffi.C.free(cached2.data)
+
+-- raw content dicts all have dictID 0, yet must not share cached outputs
+-- with each other nor with Compress
+local rawInput = '{"id":"5f1c","kind":"order","items":[{"sku":"A-17","qty":3},{"sku":"Q-02","qty":1}],"total":"41.20"}'
+local rawA = "prefix-a:" .. rawInput
+local rawB = string.rep("#", 64) .. rawInput .. "-suffix-b"
+local rawNameA = goStringType("raw-a", #"raw-a")
+local rawNameB = goStringType("raw-b", #"raw-b")
+assert(zstd.AddDictFromMemory(rawNameA, ffi.cast("void*", rawA), #rawA, 0) == 0)
+assert(zstd.AddDictFromMemory(rawNameB, ffi.cast("void*", rawB), #rawB, 0) == 0)
+local rawGo = goStringType(rawInput, #rawInput)
+local rawNone = zstd.Compress(rawGo)
+for _, name in ipairs({ rawNameA, rawNameB }) do
+    local rawOutput = zstd.CompressWithDict(rawGo, name)
+    assert(tonumber(rawOutput.size) < tonumber(rawNone.size))
+    local rawBack = zstd.DecompressWithDict(goStringType(rawOutput.data, rawOutput.size), name)
+    assert(ffi.string(rawBack.data, rawBack.size) == rawInput)
+    ffi.C.free(rawOutput.data)
+    ffi.C.free(rawBack.data)
+end
+ffi.C.free(rawNone.data)
+assert(tonumber(zstd.GetCompressCacheStats().hits) == 1)
+
+-- a replaced dict starts without cached outputs
+local rawEntries = tonumber(zstd.GetCompressCacheStats().entries)
+assert(zstd.RemoveDict(rawNameA) == 0)
+assert(zstd.RemoveDict(rawNameB) == 0)
+assert(tonumber(zstd.GetCompressCacheStats().entries) == rawEntries - 2)
+zstd.DisableCompressCache()
+
+-- compress to base64
+io.write("\n-- compress to base64\n")
+local noDict = goStringType("", 0)
+for flags = 0, 2 do
+    local encoded = zstd.CompressToBase64(compressInput, noDict, flags)
+    assert(tonumber(encoded.size) > 0)
+    local token = ffi.string(encoded.data, encoded.size)
+    ffi.C.free(encoded.data)
+    io.write(string.format("compress to base64 (flags=%d) => %s", flags, flags == 0 and token or token .. "\n"))
+    if flags == 1 then
+        assert(not token:find("[+/=\n]"))
+    end
+
+    local decoded = zstd.DecompressFromBase64(goStringType(token, #token), noDict)
+    assert(ffi.string(decoded.data, decoded.size) == actual)
+    ffi.C.free(decoded.data)
+end
+
+-- base64
+io.write("\n-- base64\n")
+local b64 = to_base64(actual)
+io.write(string.format("to_base64 => %s\n", b64))
+assert(not b64:find("\n") and from_base64(b64) == actual)
+assert(encoding.decode(encoding.encode(actual, encoding.URL_SAFE)) == actual)
+local long = string.rep(actual, 200)
+assert(from_base64(to_base64(long)) == long)
+
+-- compress probe
+io.write("\n-- compress probe\n")
+local random = {}
+local seed = 12345
+for i = 1, 16384 do
+    seed = (seed * 16807) % 2147483647
+    random[i] = string.char(math.floor(seed / 65536) % 256)
+end
+random = table.concat(random)
+local randomInput = goStringType(random, #random)
+local textInput = goStringType(string.rep(actual, 100), #actual * 100)
+io.write(string.format("probe => random=%d, text=%d\n", tonumber(zstd.ProbeCompressible(randomInput)), tonumber(zstd.ProbeCompressible(textInput))))
+zstd.EnableCompressProbe(50)
+local skippedResult = zstd.Compress(randomInput)
+assert(tonumber(skippedResult.size) == 0)
+local probedResult = zstd.Compress(textInput)
+assert(tonumber(probedResult.size) > 0)
+ffi.C.free(probedResult.data)
+zstd.DisableCompressProbe()
+
+-- small payloads
+io.write("\n-- small payloads\n")
+zstd.SetSmallMode(16, 1)
+local smallOutput = zstd.CompressSmall(compressInput, dictName)
+local smallData = ffi.string(smallOutput.data, smallOutput.size)
+ffi.C.free(smallOutput.data)
+io.write(string.format("compress small => size=%d of %d\n", #smallData, #actual))
+
+local smallDecompressOutput = zstd.DecompressSmall(goStringType(smallData, #smallData), dictName)
+assert(ffi.string(smallDecompressOutput.data, smallDecompressOutput.size) == actual)
+ffi.C.free(smallDecompressOutput.data)
+
+local tiny = "{}"
+assert(tonumber(zstd.CompressSmall(goStringType(tiny, #tiny), dictName).size) == 0)
+zstd.SetSmallMode(0, 0)
+
+-- stats
+io.write("\n-- stats\n")
+local stats = ffi.new("GoStats[1]")
+zstd.GetStats(stats)
+local compressStats = stats[0].compress
+io.write(string.format("stats => compress calls=%d, errors=%d, bytes in=%d, out=%d, latency=%dns\n", tonumber(compressStats.calls), tonumber(compressStats.errors), tonumber(compressStats.bytesIn), tonumber(compressStats.bytesOut), tonumber(compressStats.latencyNs)))
+assert(tonumber(compressStats.calls) > 0)
+assert(tonumber(stats[0].cctxAllocs) == 1)
+assert(tonumber(stats[0].skipped) == 3)
+
+-- every entry point counts a call once, also when it hands over to another
+local function callCounts()
+    zstd.GetStats(stats)
+    return tonumber(stats[0].compress.calls), tonumber(stats[0].decompress.calls)
+end
+local compressCalls, decompressCalls = callCounts()
+assert(tonumber(zstd.CompressInto(compressInput, ffi.new("uint8_t[8]"), 8)) > 8)
+local b64Token = to_base64(ngData)
+local b64Output = zstd.DecompressFromBase64(goStringType(b64Token, #b64Token), noDict)
+assert(ffi.string(b64Output.data, b64Output.size) == actual)
+ffi.C.free(b64Output.data)
+local fallbackOutput = zstd.DecompressWithDict(goStringType(streamData, #streamData), dictName)
+assert(tonumber(fallbackOutput.size) == #dictActual * 3)
+ffi.C.free(fallbackOutput.data)
+local autoStatsOutput = zstd.DecompressAuto(goStringType(streamData, #streamData))
+ffi.C.free(autoStatsOutput.data)
+local afterCompress, afterDecompress = callCounts()
+assert(afterCompress == compressCalls)
+assert(afterDecompress == decompressCalls + 3)
+
+-- ctx pool stats
+io.write("\n-- ctx pool stats\n")
+local poolStats = zstd.GetCtxPoolStats()
+io.write(string.format("ctx pool => cctx hits=%d, misses=%d, dctx hits=%d, misses=%d\n", tonumber(poolStats.cctxHits), tonumber(poolStats.cctxMisses), tonumber(poolStats.dctxHits), tonumber(poolStats.dctxMisses)))
+assert(tonumber(poolStats.cctxMisses) == 1)
+assert(tonumber(poolStats.dctxMisses) == 1)
+zstd.ReleaseCtxPool()
+
+-- shared dicts
+io.write("\n-- shared dicts\n")
+local sharedName = goStringType("shared", #"shared")
+assert(tonumber(zstd.AddSharedDict(sharedName, dictFilename, 3)) == 0)
+
+-- a worker forked before the freeze shares the arena pages but not its bump
+-- state, so it cannot add shared dicts over its siblings' tables
+local childName = goStringType("shared-child", #"shared-child")
+local pid = ffi.C.fork()
+assert(pid >= 0)
+if pid == 0 then
+    ffi.C._exit(tonumber(zstd.AddSharedDict(childName, dictFilename, 3)) == -1 and 0 or 1)
+end
+local status = ffi.new("int[1]")
+assert(ffi.C.waitpid(pid, status, 0) == pid)
+assert(status[0] == 0)
+
+assert(tonumber(zstd.FreezeSharedDicts()) == 0)
+
+local sharedInput = goStringType(dictActual, #dictActual)
+local sharedOutput = zstd.CompressWithDict(sharedInput, sharedName)
+assert(tonumber(sharedOutput.size) > 0)
+local sharedData = goStringType(sharedOutput.data, sharedOutput.size)
+local sharedBack = zstd.DecompressWithDict(sharedData, sharedName)
+assert(ffi.string(sharedBack.data, sharedBack.size) == dictActual)
+ffi.C.free(sharedBack.data)
+
+-- the frozen arena is read-only, so no shared dict can be added anymore
+local lateName = goStringType("shared-late", #"shared-late")
+assert(tonumber(zstd.AddSharedDict(lateName, dictFilename, 3)) == -1)
+
+-- RemoveDict unregisters a shared dict but, as documented, leaks its arena
+-- memory: the name cannot be added back as a shared dict, and a stream that
+-- still holds the entry keeps using the read-only tables
+local sharedStream = zstd.DecompressStreamBegin(sharedName, 0)
+assert(sharedStream ~= nil)
+assert(tonumber(zstd.RemoveDict(sharedName)) == 0)
+assert(tonumber(zstd.DecompressWithDict(sharedData, sharedName).size) == -1)
+assert(tonumber(zstd.AddSharedDict(sharedName, dictFilename, 3)) == -1)
+local sharedStreamOutput = zstd.DecompressStreamFeed(sharedStream, sharedData)
+assert(ffi.string(sharedStreamOutput.data, sharedStreamOutput.size) == dictActual)
+zstd.DecompressStreamEnd(sharedStream)
+ffi.C.free(sharedOutput.data)